@@ -0,0 +1,939 @@
+/*
+ * file:        bcache.c
+ * description: LRU buffer cache layered over a block device
+ *
+ * The cache is itself a block device, so it can be stacked on top of
+ * any other block device and used through the same operations. Cached
+ * blocks are kept in a hash table keyed by block number, and on a
+ * doubly-linked list in least-recently-used order. Writes go through
+ * to the underlying device and update any cached copy.
+ *
+ * In write-back mode, writes only update the cache and mark the blocks
+ * dirty. A flusher thread writes dirty blocks back in runs of adjacent
+ * blocks, one request per run, once they have been dirty for
+ * BCACHE_DIRTY_EXPIRE_SECS or when the number of dirty blocks passes a
+ * background limit. A writer that finds the cache above the hard limit
+ * writes everything back itself. Evicting a dirty block writes back the
+ * run of dirty blocks around it, and flush and close write back all
+ * dirty blocks.
+ *
+ * The cache lock is not held while a run is written back. Its buffers
+ * are marked busy instead: they stay in place and keep their contents
+ * until the write finishes, and threads that need to change them wait.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkdev.h"
+#include "bcache.h"
+
+/** a cached block */
+struct bcache_buf {
+    int blkno;                      // block number, or -1 if unused
+    struct bcache_buf *hnext;       // next buffer in hash chain
+    struct bcache_buf *prev;        // previous buffer in LRU list
+    struct bcache_buf *next;        // next buffer in LRU list
+    bool dirty;                     // contents not yet written to device
+    bool busy;                      // being written back to device
+    time_t dirtied;                 // time buffer became dirty
+    char data[BLOCK_SIZE];          // block contents
+};
+
+/** write-back limits */
+enum {
+    BCACHE_MAX_RUN = 256,           // most blocks written back per request
+    BCACHE_DIRTY_BACKGROUND_PCT = 25, // percent dirty to wake the flusher
+    BCACHE_DIRTY_LIMIT_PCT = 50     // percent dirty at which writers flush
+};
+
+/** definition of buffer cache block device */
+struct bcache_dev {
+    struct blkdev *dev;             // underlying block device
+    int nbufs;                      // number of buffers
+    struct bcache_buf *bufs;        // buffer storage
+    struct bcache_buf **hash;       // hash table of buffer chains
+    int hash_mask;                  // hash table size - 1
+    struct bcache_buf lru;          // LRU list head: next is most recent
+    long hits;                      // number of blocks found in cache
+    long misses;                    // number of blocks read from device
+    bool writeback;                 // write-back mode
+    int ndirty;                     // number of dirty buffers
+    int dirty_background;           // dirty buffers to wake the flusher
+    int dirty_limit;                // dirty buffers at which writers flush
+    long written_back;              // number of dirty blocks written back
+    int nbusy;                      // number of busy buffers
+    pthread_cond_t unbusy;          // signaled when buffers stop being busy
+    struct bcache_buf **dirty_list; // dirty buffers being written back
+    bool writing_back;              // dirty_list is in use
+    bool flusher_running;           // flusher thread has been started
+    bool flusher_stop;              // flusher thread should exit
+    pthread_t flusher;              // flusher thread
+    pthread_cond_t flusher_wake;    // wakes flusher thread
+    pthread_mutex_t lock;           // protects all of the above
+};
+
+static struct blkdev_ops bcache_ops;
+
+/**
+ * Get hash chain for a block number.
+ *
+ * @param bc the buffer cache
+ * @param blkno the block number
+ * @return pointer to the head of the hash chain
+ */
+static struct bcache_buf **bcache_chain(struct bcache_dev *bc, int blkno)
+{
+    return &bc->hash[blkno & bc->hash_mask];
+}
+
+/**
+ * Unlink a buffer from the LRU list.
+ *
+ * @param b the buffer
+ */
+static void lru_remove(struct bcache_buf *b)
+{
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+/**
+ * Link a buffer at the most-recently-used end of the LRU list.
+ *
+ * @param bc the buffer cache
+ * @param b the buffer
+ */
+static void lru_push(struct bcache_dev *bc, struct bcache_buf *b)
+{
+    b->next = bc->lru.next;
+    b->prev = &bc->lru;
+    bc->lru.next->prev = b;
+    bc->lru.next = b;
+}
+
+/**
+ * Find a cached block without changing its LRU position.
+ *
+ * @param bc the buffer cache
+ * @param blkno the block number
+ * @return the buffer or NULL if block is not cached
+ */
+static struct bcache_buf *bcache_find(struct bcache_dev *bc, int blkno)
+{
+    for (struct bcache_buf *b = *bcache_chain(bc, blkno); b != NULL; b = b->hnext) {
+        if (b->blkno == blkno) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find a cached block and make it the most recently used.
+ *
+ * @param bc the buffer cache
+ * @param blkno the block number
+ * @return the buffer or NULL if block is not cached
+ */
+static struct bcache_buf *bcache_lookup(struct bcache_dev *bc, int blkno)
+{
+    struct bcache_buf *b = bcache_find(bc, blkno);
+    if (b != NULL) {
+        lru_remove(b);
+        lru_push(bc, b);
+    }
+    return b;
+}
+
+/**
+ * Remove a buffer from its hash chain.
+ *
+ * @param bc the buffer cache
+ * @param b the buffer
+ */
+static void bcache_unhash(struct bcache_dev *bc, struct bcache_buf *b)
+{
+    for (struct bcache_buf **pp = bcache_chain(bc, b->blkno); *pp != NULL; pp = &(*pp)->hnext) {
+        if (*pp == b) {
+            *pp = b->hnext;
+            break;
+        }
+    }
+    b->blkno = -1;
+}
+
+/**
+ * Mark buffers busy, so they are left alone while the cache
+ * lock is dropped to write them back.
+ *
+ * @param bc the buffer cache
+ * @param run the buffers
+ * @param n the number of buffers
+ */
+static void bcache_set_busy(struct bcache_dev *bc, struct bcache_buf **run, int n)
+{
+    for (int i = 0; i < n; i++) {
+        run[i]->busy = true;
+    }
+    bc->nbusy += n;
+}
+
+/**
+ * Write a run of busy dirty buffers for consecutive blocks to the
+ * underlying device with one request, and mark them clean. The
+ * cache lock is dropped during the write; the buffers are no longer
+ * busy on return, whether or not the write succeeded.
+ *
+ * @param bc the buffer cache
+ * @param run the buffers in block order
+ * @param n the number of buffers, at most BCACHE_MAX_RUN
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_write_run(struct bcache_dev *bc, struct bcache_buf **run, int n)
+{
+    if (n <= 0) {
+        return SUCCESS;
+    }
+    struct iovec iov[BCACHE_MAX_RUN];
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = run[i]->data;
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    int result = blkdev_writev(bc->dev, run[0]->blkno, iov, n);
+    pthread_mutex_lock(&bc->lock);
+
+    for (int i = 0; i < n; i++) {
+        run[i]->busy = false;
+        if (result == SUCCESS) {
+            run[i]->dirty = false;
+        }
+    }
+    bc->nbusy -= n;
+    if (result == SUCCESS) {
+        bc->ndirty -= n;
+        bc->written_back += n;
+    }
+    pthread_cond_broadcast(&bc->unbusy);
+    return result;
+}
+
+/**
+ * Write back a dirty buffer along with the dirty buffers for
+ * the blocks next to it.
+ *
+ * @param bc the buffer cache
+ * @param b the dirty buffer
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_clean(struct bcache_dev *bc, struct bcache_buf *b)
+{
+    struct bcache_buf *run[BCACHE_MAX_RUN], *p;
+    int first = b->blkno;
+    while (b->blkno - first < BCACHE_MAX_RUN / 2
+           && (p = bcache_find(bc, first - 1)) != NULL && p->dirty && !p->busy) {
+        first--;
+    }
+    int n = 0;
+    while (n < BCACHE_MAX_RUN && (p = bcache_find(bc, first + n)) != NULL && p->dirty && !p->busy) {
+        run[n++] = p;
+    }
+    bcache_set_busy(bc, run, n);
+    return bcache_write_run(bc, run, n);
+}
+
+/**
+ * Compare dirty buffers by block number for qsort.
+ *
+ * @param a pointer to first buffer pointer
+ * @param b pointer to second buffer pointer
+ * @return negative, zero, or positive as a is before, at, or after b
+ */
+static int bcache_buf_cmp(const void *a, const void *b)
+{
+    int x = (*(struct bcache_buf * const *) a)->blkno;
+    int y = (*(struct bcache_buf * const *) b)->blkno;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write back dirty buffers in runs of consecutive blocks. A run is
+ * written if any of its buffers is old enough, so recently dirtied
+ * neighbors go out in the same request.
+ *
+ * @param bc the buffer cache
+ * @param all true to write back all dirty buffers
+ * @param expire write runs with a buffer dirtied at or before this time
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_writeback(struct bcache_dev *bc, bool all, time_t expire)
+{
+    /* the dirty list is used by one write-back at a time */
+    while (bc->writing_back) {
+        pthread_cond_wait(&bc->unbusy, &bc->lock);
+    }
+    bc->writing_back = true;
+
+    int n = 0;
+    for (int i = 0; i < bc->nbufs && n < bc->ndirty; i++) {
+        if (bc->bufs[i].dirty && !bc->bufs[i].busy) {
+            bc->dirty_list[n++] = &bc->bufs[i];
+        }
+    }
+    qsort(bc->dirty_list, n, sizeof(*bc->dirty_list), bcache_buf_cmp);
+
+    /* keep the runs to write at the front of the list and mark them busy */
+    struct bcache_buf **list = bc->dirty_list;
+    int nwrite = 0;
+    for (int i = 0; i < n; ) {
+        bool expired = all || list[i]->dirtied <= expire;
+        int len = 1;
+        while (i + len < n && len < BCACHE_MAX_RUN && list[i + len]->blkno == list[i]->blkno + len) {
+            expired = expired || list[i + len]->dirtied <= expire;
+            len++;
+        }
+        if (expired) {
+            memmove(&list[nwrite], &list[i], len * sizeof(*list));
+            nwrite += len;
+        }
+        i += len;
+    }
+    bcache_set_busy(bc, list, nwrite);
+
+    int result = SUCCESS;
+    for (int i = 0; i < nwrite; ) {
+        int len = 1;
+        while (i + len < nwrite && len < BCACHE_MAX_RUN && list[i + len]->blkno == list[i]->blkno + len) {
+            len++;
+        }
+        if (result == SUCCESS) {
+            result = bcache_write_run(bc, &list[i], len);
+        } else {
+            for (int j = 0; j < len; j++) {
+                list[i + j]->busy = false;
+            }
+            bc->nbusy -= len;
+        }
+        i += len;
+    }
+
+    /* runs other threads are writing are part of everything */
+    while (all && result == SUCCESS && bc->nbusy > 0) {
+        pthread_cond_wait(&bc->unbusy, &bc->lock);
+    }
+    bc->writing_back = false;
+    pthread_cond_broadcast(&bc->unbusy);
+    return result;
+}
+
+/**
+ * Flusher thread: once a second, write back blocks that have been
+ * dirty long enough, or all dirty blocks if above the background limit.
+ *
+ * @param arg the buffer cache
+ * @return NULL
+ */
+static void *bcache_flusher(void *arg)
+{
+    struct bcache_dev *bc = arg;
+
+    pthread_mutex_lock(&bc->lock);
+    while (!bc->flusher_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&bc->flusher_wake, &bc->lock, &ts);
+        if (bc->ndirty == 0) {
+            continue;
+        }
+        bool all = bc->ndirty >= bc->dirty_background;
+        if (bcache_writeback(bc, all, time(NULL) - BCACHE_DIRTY_EXPIRE_SECS) < 0) {
+            fprintf(stderr, "block cache: write-back failed\n");
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return NULL;
+}
+
+/**
+ * Keep the number of dirty blocks within bounds after a write,
+ * starting the flusher thread on the first write. The thread is
+ * started here rather than at create because the process may
+ * fork between creating the device and using it.
+ *
+ * @param bc the buffer cache
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_throttle(struct bcache_dev *bc)
+{
+    if (!bc->flusher_running && bc->ndirty > 0) {
+        bc->flusher_stop = false;
+        if (pthread_create(&bc->flusher, NULL, bcache_flusher, bc) == 0) {
+            bc->flusher_running = true;
+        }
+    }
+    if (bc->ndirty >= bc->dirty_limit || (!bc->flusher_running && bc->ndirty >= bc->dirty_background)) {
+        return bcache_writeback(bc, true, 0);
+    }
+    if (bc->ndirty >= bc->dirty_background) {
+        pthread_cond_signal(&bc->flusher_wake);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Insert a copy of a block into the cache, updating the cached
+ * copy if present or else replacing the least recently used buffer
+ * that is not busy. A dirty buffer is written back before it is
+ * replaced. The cache lock may be dropped while waiting for a busy
+ * buffer or writing back a dirty one.
+ *
+ * @param bc the buffer cache
+ * @param blkno the block number
+ * @param data the block contents
+ * @param replace true to update a cached copy, false to keep it
+ *   because data was read from the device and may be older
+ * @return the buffer, or NULL if a dirty buffer could not be written back
+ */
+static struct bcache_buf *bcache_insert(struct bcache_dev *bc, int blkno, const void *data, bool replace)
+{
+    struct bcache_buf *b;
+    for (;;) {
+        if ((b = bcache_lookup(bc, blkno)) != NULL) {
+            if (!replace) {
+                return b;
+            }
+            if (!b->busy) {
+                memcpy(b->data, data, BLOCK_SIZE);
+                return b;
+            }
+            pthread_cond_wait(&bc->unbusy, &bc->lock);
+            continue;
+        }
+
+        b = bc->lru.prev;
+        while (b != &bc->lru && b->busy) {
+            b = b->prev;
+        }
+        if (b == &bc->lru) {
+            pthread_cond_wait(&bc->unbusy, &bc->lock);
+            continue;
+        }
+        if (!b->dirty) {
+            break;
+        }
+        /* another thread may cache the block while this one is written */
+        if (bcache_clean(bc, b) < 0) {
+            return NULL;
+        }
+    }
+
+    if (b->blkno != -1) {
+        bcache_unhash(bc, b);
+    }
+    b->blkno = blkno;
+    memcpy(b->data, data, BLOCK_SIZE);
+
+    struct bcache_buf **chain = bcache_chain(bc, blkno);
+    b->hnext = *chain;
+    *chain = b;
+    lru_remove(b);
+    lru_push(bc, b);
+    return b;
+}
+
+/**
+ * Write a block into the cache only, marking it dirty. If it
+ * cannot be cached it is written through to the device.
+ *
+ * @param bc the buffer cache
+ * @param blkno the block number
+ * @param data the block contents
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_write_dirty(struct bcache_dev *bc, int blkno, void *data)
+{
+    struct bcache_buf *b = bcache_insert(bc, blkno, data, true);
+    if (b == NULL) {
+        return bc->dev->ops->write(bc->dev, blkno, 1, data);
+    }
+    if (!b->dirty) {
+        b->dirty = true;
+        b->dirtied = time(NULL);
+        bc->ndirty++;
+    }
+    return SUCCESS;
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param dev the block device
+ */
+static int bcache_num_blocks(struct blkdev *dev)
+{
+    struct bcache_dev *bc = dev->private;
+    return bc->dev->ops->num_blocks(bc->dev);
+}
+
+/**
+ * Read blocks from the cache, reading runs of missing blocks
+ * from the underlying device with one request per run.
+ *
+ * @param dev the block device
+ * @param first_blk the first block number
+ * @param num_blks number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_read(struct blkdev *dev, int first_blk, int num_blks, void *buf)
+{
+    struct bcache_dev *bc = dev->private;
+    char *p = buf;
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&bc->lock);
+    for (int i = 0; i < num_blks; ) {
+        struct bcache_buf *b = bcache_lookup(bc, first_blk + i);
+        if (b != NULL) {
+            memcpy(p + i * BLOCK_SIZE, b->data, BLOCK_SIZE);
+            bc->hits++;
+            i++;
+            continue;
+        }
+
+        /* find the run of blocks that are not cached */
+        int n = 1;
+        while (i + n < num_blks && bcache_lookup(bc, first_blk + i + n) == NULL) {
+            n++;
+        }
+        result = bc->dev->ops->read(bc->dev, first_blk + i, n, p + i * BLOCK_SIZE);
+        if (result < 0) {
+            break;
+        }
+        for (int j = 0; j < n; j++) {
+            bcache_insert(bc, first_blk + i + j, p + (i + j) * BLOCK_SIZE, false);
+        }
+        bc->misses += n;
+        i += n;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return result;
+}
+
+/**
+ * Write blocks through to the underlying device, updating
+ * the cached copy of each block. In write-back mode the blocks
+ * are only written to the cache and marked dirty.
+ *
+ * @param dev the block device
+ * @param first_blk the first block number
+ * @param num_blks number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_write(struct blkdev *dev, int first_blk, int num_blks, void *buf)
+{
+    struct bcache_dev *bc = dev->private;
+    char *p = buf;
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&bc->lock);
+    if (bc->writeback) {
+        for (int i = 0; i < num_blks && result == SUCCESS; i++) {
+            result = bcache_write_dirty(bc, first_blk + i, p + i * BLOCK_SIZE);
+        }
+        if (result == SUCCESS) {
+            result = bcache_throttle(bc);
+        }
+    } else {
+        result = bc->dev->ops->write(bc->dev, first_blk, num_blks, buf);
+        if (result == SUCCESS) {
+            for (int i = 0; i < num_blks; i++) {
+                bcache_insert(bc, first_blk + i, p + i * BLOCK_SIZE, true);
+            }
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return result;
+}
+
+/**
+ * Serve a read request from the cache if all of its blocks
+ * are cached.
+ *
+ * @param bc the buffer cache
+ * @param req the read request
+ * @return 1 if request was served, 0 if not
+ */
+static int bcache_read_cached(struct bcache_dev *bc, struct blkdev_req *req)
+{
+    for (int i = 0; i < req->num_blks; i++) {
+        if (bcache_lookup(bc, req->first_blk + i) == NULL) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < req->num_blks; i++) {
+        memcpy(blkdev_req_block(req, i), bcache_lookup(bc, req->first_blk + i)->data, BLOCK_SIZE);
+    }
+    bc->hits += req->num_blks;
+    req->status = SUCCESS;
+    req->done = 1;
+    return 1;
+}
+
+/**
+ * In write-back mode, serve a read request that includes dirty
+ * blocks, whose device copies are stale, by reading the blocks that
+ * are not cached synchronously.
+ *
+ * @param bc the buffer cache
+ * @param req the read request
+ * @return 1 if request was served, 0 if it has no dirty blocks
+ */
+static int bcache_read_dirty(struct bcache_dev *bc, struct blkdev_req *req)
+{
+    struct bcache_buf *b;
+    int i;
+    for (i = 0; i < req->num_blks; i++) {
+        if ((b = bcache_find(bc, req->first_blk + i)) != NULL && b->dirty) {
+            break;
+        }
+    }
+    if (i == req->num_blks) {
+        return 0;
+    }
+
+    req->status = SUCCESS;
+    for (i = 0; i < req->num_blks; i++) {
+        char *data = blkdev_req_block(req, i);
+        if ((b = bcache_lookup(bc, req->first_blk + i)) != NULL) {
+            memcpy(data, b->data, BLOCK_SIZE);
+            bc->hits++;
+        } else if ((req->status = bc->dev->ops->read(bc->dev, req->first_blk + i, 1, data)) < 0) {
+            break;
+        } else {
+            bcache_insert(bc, req->first_blk + i, data, false);
+            bc->misses++;
+        }
+    }
+    req->done = 1;
+    return 1;
+}
+
+/**
+ * In write-back mode, serve a write request by writing its
+ * blocks to the cache only.
+ *
+ * @param bc the buffer cache
+ * @param req the write request
+ * @return 1 if request was served, 0 if not in write-back mode
+ */
+static int bcache_write_cached(struct bcache_dev *bc, struct blkdev_req *req)
+{
+    if (!bc->writeback) {
+        return 0;
+    }
+    req->status = SUCCESS;
+    for (int i = 0; i < req->num_blks && req->status == SUCCESS; i++) {
+        req->status = bcache_write_dirty(bc, req->first_blk + i, blkdev_req_block(req, i));
+    }
+    req->done = 1;
+    return 1;
+}
+
+/**
+ * Serve a request from the cache if possible.
+ *
+ * @param bc the buffer cache
+ * @param req the request
+ * @return 1 if request was served, 0 if it needs the device
+ */
+static int bcache_serve(struct bcache_dev *bc, struct blkdev_req *req)
+{
+    if (req->op == BLKDEV_READ) {
+        return bcache_read_cached(bc, req) || (bc->writeback && bcache_read_dirty(bc, req));
+    }
+    return bcache_write_cached(bc, req);
+}
+
+/**
+ * Submit requests, serving reads of cached blocks directly and
+ * passing runs of the remaining requests to the underlying device.
+ * Writes update the cache when submitted, and in write-back mode
+ * are not passed to the device.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if submitted, or underlying device error
+ */
+static int bcache_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct bcache_dev *bc = dev->private;
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&bc->lock);
+    for (int i = 0; i < nreqs; ) {
+        reqs[i].done = 0;
+        if (bcache_serve(bc, &reqs[i])) {
+            i++;
+            continue;
+        }
+
+        /* find the run of requests that need the device */
+        int n = 0;
+        while (i + n < nreqs) {
+            struct blkdev_req *req = &reqs[i + n];
+            req->done = 0;
+            if (n > 0 && bcache_serve(bc, req)) {
+                break;
+            }
+            if (req->op == BLKDEV_READ) {
+                bc->misses += req->num_blks;
+            } else {
+                for (int j = 0; j < req->num_blks; j++) {
+                    bcache_insert(bc, req->first_blk + j, blkdev_req_block(req, j), true);
+                }
+            }
+            n++;
+        }
+        result = blkdev_submit(bc->dev, &reqs[i], n);
+        if (result < 0) {
+            break;
+        }
+        i += n;
+    }
+    if (result == SUCCESS && bc->writeback) {
+        result = bcache_throttle(bc);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return result;
+}
+
+/**
+ * Wait for submitted requests to complete, adding the
+ * blocks of completed reads to the cache.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or first error status
+ */
+static int bcache_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct bcache_dev *bc = dev->private;
+    int result = blkdev_complete(bc->dev, reqs, nreqs);
+
+    pthread_mutex_lock(&bc->lock);
+    for (int i = 0; i < nreqs; i++) {
+        struct blkdev_req *req = &reqs[i];
+        if (req->op != BLKDEV_READ || req->status != SUCCESS) {
+            continue;
+        }
+        /* a write submitted since the read may have cached newer data */
+        for (int j = 0; j < req->num_blks; j++) {
+            bcache_insert(bc, req->first_blk + j, blkdev_req_block(req, j), false);
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return result;
+}
+
+/**
+ * Write back all dirty blocks and flush the underlying device.
+ *
+ * @param dev the block device
+ * @param first_blk the first block number
+ * @param num_blks number of blocks to flush
+ * @return SUCCESS if successful, or underlying device error
+ */
+static int bcache_flush(struct blkdev *dev, int first_blk, int num_blks)
+{
+    struct bcache_dev *bc = dev->private;
+
+    pthread_mutex_lock(&bc->lock);
+    int result = bcache_writeback(bc, true, 0);
+    pthread_mutex_unlock(&bc->lock);
+    if (result < 0) {
+        return result;
+    }
+    return bc->dev->ops->flush(bc->dev, first_blk, num_blks);
+}
+
+/**
+ * Close the cache and the underlying device.
+ *
+ * @param dev the block device
+ */
+static void bcache_close(struct blkdev *dev)
+{
+    struct bcache_dev *bc = dev->private;
+
+    pthread_mutex_lock(&bc->lock);
+    if (bc->flusher_running) {
+        bc->flusher_stop = true;
+        pthread_cond_signal(&bc->flusher_wake);
+        pthread_mutex_unlock(&bc->lock);
+        pthread_join(bc->flusher, NULL);
+        pthread_mutex_lock(&bc->lock);
+        bc->flusher_running = false;
+    }
+    if (bcache_writeback(bc, true, 0) < 0) {
+        fprintf(stderr, "block cache: write-back failed, %d blocks lost\n", bc->ndirty);
+    }
+    pthread_mutex_unlock(&bc->lock);
+
+    bc->dev->ops->close(bc->dev);
+    pthread_cond_destroy(&bc->flusher_wake);
+    pthread_cond_destroy(&bc->unbusy);
+    pthread_mutex_destroy(&bc->lock);
+    free(bc->dirty_list);
+    free(bc->hash);
+    free(bc->bufs);
+    free(bc);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops bcache_ops = {
+    .num_blocks = bcache_num_blocks,
+    .read = bcache_read,
+    .write = bcache_write,
+    .flush = bcache_flush,
+    .close = bcache_close,
+    .submit = bcache_submit,
+    .complete = bcache_complete
+};
+
+/**
+ * Create a buffer cache block device on top of another block
+ * device. Reads are served from the cache where possible and
+ * writes go through to the underlying device. Closing the cache
+ * device also closes the underlying device.
+ *
+ * @param dev the underlying block device
+ * @param nblks the cache size in blocks
+ * @return the cache block device, dev itself if nblks <= 0,
+ *   or NULL if cannot allocate the cache
+ */
+struct blkdev *bcache_create(struct blkdev *dev, int nblks)
+{
+    if (nblks <= 0) {
+        return dev;
+    }
+
+    struct blkdev *cdev = malloc(sizeof(*cdev));
+    struct bcache_dev *bc = calloc(1, sizeof(*bc));
+    if (cdev == NULL || bc == NULL) {
+        free(cdev);
+        free(bc);
+        return NULL;
+    }
+
+    /* hash table size is the next power of two */
+    int nhash = 1;
+    while (nhash < nblks) {
+        nhash <<= 1;
+    }
+    bc->hash = calloc(nhash, sizeof(*bc->hash));
+    bc->bufs = malloc(nblks * sizeof(*bc->bufs));
+    bc->dirty_list = malloc(nblks * sizeof(*bc->dirty_list));
+    if (bc->hash == NULL || bc->bufs == NULL || bc->dirty_list == NULL) {
+        fprintf(stderr, "can't allocate %d block cache\n", nblks);
+        free(bc->dirty_list);
+        free(bc->bufs);
+        free(bc->hash);
+        free(bc);
+        free(cdev);
+        return NULL;
+    }
+    bc->hash_mask = nhash - 1;
+    bc->nbufs = nblks;
+    bc->dev = dev;
+    bc->dirty_background = nblks * BCACHE_DIRTY_BACKGROUND_PCT / 100 + 1;
+    bc->dirty_limit = nblks * BCACHE_DIRTY_LIMIT_PCT / 100 + 1;
+
+    /* all buffers start out unused on the LRU list */
+    bc->lru.next = bc->lru.prev = &bc->lru;
+    for (int i = 0; i < nblks; i++) {
+        bc->bufs[i].blkno = -1;
+        bc->bufs[i].hnext = NULL;
+        bc->bufs[i].dirty = false;
+        bc->bufs[i].busy = false;
+        lru_push(bc, &bc->bufs[i]);
+    }
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_cond_init(&bc->flusher_wake, NULL);
+    pthread_cond_init(&bc->unbusy, NULL);
+
+    cdev->private = bc;
+    cdev->ops = &bcache_ops;
+    return cdev;
+}
+
+/**
+ * Get hit and miss counters of a buffer cache block device.
+ *
+ * @param dev the cache block device
+ * @param hits pointer to space for the number of block hits
+ * @param misses pointer to space for the number of block misses
+ * @return SUCCESS, or E_UNAVAIL if dev is not a cache device
+ */
+int bcache_stats(struct blkdev *dev, long *hits, long *misses)
+{
+    if (dev->ops != &bcache_ops) {
+        return E_UNAVAIL;
+    }
+    struct bcache_dev *bc = dev->private;
+    pthread_mutex_lock(&bc->lock);
+    *hits = bc->hits;
+    *misses = bc->misses;
+    pthread_mutex_unlock(&bc->lock);
+    return SUCCESS;
+}
+
+/**
+ * Switch a buffer cache block device to write-back mode.
+ *
+ * @param dev the cache block device
+ * @return SUCCESS, or E_UNAVAIL if dev is not a cache device
+ */
+int bcache_set_writeback(struct blkdev *dev)
+{
+    if (dev->ops != &bcache_ops) {
+        return E_UNAVAIL;
+    }
+    struct bcache_dev *bc = dev->private;
+    pthread_mutex_lock(&bc->lock);
+    bc->writeback = true;
+    pthread_mutex_unlock(&bc->lock);
+    return SUCCESS;
+}
+
+/**
+ * Get write-back counters of a buffer cache block device.
+ *
+ * @param dev the cache block device
+ * @param dirty pointer to space for the number of dirty blocks
+ * @param written_back pointer to space for the number of blocks written back
+ * @return SUCCESS, or E_UNAVAIL if dev is not a cache device
+ */
+int bcache_writeback_stats(struct blkdev *dev, long *dirty, long *written_back)
+{
+    if (dev->ops != &bcache_ops) {
+        return E_UNAVAIL;
+    }
+    struct bcache_dev *bc = dev->private;
+    pthread_mutex_lock(&bc->lock);
+    *dirty = bc->ndirty;
+    *written_back = bc->written_back;
+    pthread_mutex_unlock(&bc->lock);
+    return SUCCESS;
+}
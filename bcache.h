@@ -0,0 +1,61 @@
+/*
+ * file:        bcache.h
+ * description: LRU buffer cache layered over a block device
+ */
+
+#ifndef BCACHE_H_
+#define BCACHE_H_
+
+#include "blkdev.h"
+
+/** default cache size in blocks */
+enum {BCACHE_DEFAULT_BLKS = 1024};
+
+/** seconds a block may stay dirty in write-back mode */
+enum {BCACHE_DIRTY_EXPIRE_SECS = 5};
+
+/**
+ * Create a buffer cache block device on top of another block
+ * device. Reads are served from the cache where possible and
+ * writes go through to the underlying device. Closing the cache
+ * device also closes the underlying device.
+ *
+ * @param dev the underlying block device
+ * @param nblks the cache size in blocks
+ * @return the cache block device, dev itself if nblks <= 0,
+ *   or NULL if cannot allocate the cache
+ */
+extern struct blkdev *bcache_create(struct blkdev *dev, int nblks);
+
+/**
+ * Get hit and miss counters of a buffer cache block device.
+ *
+ * @param dev the cache block device
+ * @param hits pointer to space for the number of block hits
+ * @param misses pointer to space for the number of block misses
+ * @return SUCCESS, or E_UNAVAIL if dev is not a cache device
+ */
+extern int bcache_stats(struct blkdev *dev, long *hits, long *misses);
+
+/**
+ * Switch a buffer cache block device to write-back mode. Writes
+ * then only update the cache, and dirty blocks are written to the
+ * underlying device by a background thread, when evicted, or when
+ * the cache device is flushed or closed.
+ *
+ * @param dev the cache block device
+ * @return SUCCESS, or E_UNAVAIL if dev is not a cache device
+ */
+extern int bcache_set_writeback(struct blkdev *dev);
+
+/**
+ * Get write-back counters of a buffer cache block device.
+ *
+ * @param dev the cache block device
+ * @param dirty pointer to space for the number of dirty blocks
+ * @param written_back pointer to space for the number of blocks written back
+ * @return SUCCESS, or E_UNAVAIL if dev is not a cache device
+ */
+extern int bcache_writeback_stats(struct blkdev *dev, long *dirty, long *written_back);
+
+#endif /* BCACHE_H_ */
@@ -0,0 +1,95 @@
+/*
+ * file:        bitmap.c
+ * description: Word-at-a-time search and count for 64-bit word bitmaps
+ */
+
+#include "bitmap.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/**
+ * Skip whole words equal to a fill pattern, four words at a time
+ * with AVX2 if available.
+ *
+ * @param map the bitmap
+ * @param w the first word to examine
+ * @param nwords the number of words in the bitmap
+ * @param fill the pattern to skip, all ones or all zeros
+ * @return the first word not equal to fill, or nwords if none
+ */
+static int bitmap_skip(const uint64_t *map, int w, int nwords, uint64_t fill)
+{
+#ifdef __AVX2__
+    __m256i pattern = _mm256_set1_epi64x((long long) fill);
+    for ( ; w + 4 <= nwords; w += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (map + w));
+        __m256i eq = _mm256_cmpeq_epi64(v, pattern);
+        if (_mm256_movemask_epi8(eq) != -1) {
+            break;
+        }
+    }
+#endif
+    while (w < nwords && map[w] == fill) {
+        w++;
+    }
+    return w;
+}
+
+/**
+ * Find the first bit at or after a starting bit whose value is
+ * the opposite of a fill pattern.
+ *
+ * @param map the bitmap
+ * @param start the bit to start searching from
+ * @param nbits the number of bits in the bitmap
+ * @param fill all ones to find a clear bit, all zeros to find a set bit
+ * @return the bit number, or -1 if not found
+ */
+static int bitmap_find(const uint64_t *map, int start, int nbits, uint64_t fill)
+{
+    if (start < 0) {
+        start = 0;
+    }
+    if (start >= nbits) {
+        return -1;
+    }
+    int nwords = (nbits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    int w = start / BITMAP_WORD_BITS;
+    uint64_t word = (map[w] ^ fill) & (~(uint64_t) 0 << (start % BITMAP_WORD_BITS));
+    if (word == 0) {
+        w = bitmap_skip(map, w + 1, nwords, fill);
+        if (w >= nwords) {
+            return -1;
+        }
+        word = map[w] ^ fill;
+    }
+    int bit = w * BITMAP_WORD_BITS + __builtin_ctzll(word);
+    return bit < nbits ? bit : -1;
+}
+
+int bitmap_find_zero(const uint64_t *map, int start, int nbits)
+{
+    return bitmap_find(map, start, nbits, ~(uint64_t) 0);
+}
+
+int bitmap_find_set(const uint64_t *map, int start, int nbits)
+{
+    return bitmap_find(map, start, nbits, 0);
+}
+
+int bitmap_count_zero(const uint64_t *map, int nbits)
+{
+    int full = nbits / BITMAP_WORD_BITS;
+    int count = 0;
+    for (int w = 0; w < full; w++) {
+        count += BITMAP_WORD_BITS - __builtin_popcountll(map[w]);
+    }
+    int rest = nbits % BITMAP_WORD_BITS;
+    if (rest != 0) {
+        uint64_t mask = ((uint64_t) 1 << rest) - 1;
+        count += rest - __builtin_popcountll(map[full] & mask);
+    }
+    return count;
+}
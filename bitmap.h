@@ -0,0 +1,81 @@
+/*
+ * file:        bitmap.h
+ * description: Bitmaps of 64-bit words for the inode and block maps
+ *
+ * Bit i is bit (i % 64) of word (i / 64), which on a little-endian
+ * host is the same on-disk layout as the fd_set maps it replaces.
+ */
+
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** number of bits in a bitmap word */
+enum {BITMAP_WORD_BITS = 64};
+
+/**
+ * Test a bit in a bitmap.
+ *
+ * @param map the bitmap
+ * @param i the bit number
+ * @return true if the bit is set
+ */
+static inline bool bitmap_test(const uint64_t *map, int i)
+{
+    return (map[i / BITMAP_WORD_BITS] >> (i % BITMAP_WORD_BITS)) & 1;
+}
+
+/**
+ * Set a bit in a bitmap.
+ *
+ * @param map the bitmap
+ * @param i the bit number
+ */
+static inline void bitmap_set(uint64_t *map, int i)
+{
+    map[i / BITMAP_WORD_BITS] |= (uint64_t) 1 << (i % BITMAP_WORD_BITS);
+}
+
+/**
+ * Clear a bit in a bitmap.
+ *
+ * @param map the bitmap
+ * @param i the bit number
+ */
+static inline void bitmap_clear(uint64_t *map, int i)
+{
+    map[i / BITMAP_WORD_BITS] &= ~((uint64_t) 1 << (i % BITMAP_WORD_BITS));
+}
+
+/**
+ * Find the first clear bit at or after a starting bit.
+ *
+ * @param map the bitmap
+ * @param start the bit to start searching from
+ * @param nbits the number of bits in the bitmap
+ * @return the bit number, or -1 if all bits from start are set
+ */
+extern int bitmap_find_zero(const uint64_t *map, int start, int nbits);
+
+/**
+ * Find the first set bit at or after a starting bit.
+ *
+ * @param map the bitmap
+ * @param start the bit to start searching from
+ * @param nbits the number of bits in the bitmap
+ * @return the bit number, or -1 if no bits from start are set
+ */
+extern int bitmap_find_set(const uint64_t *map, int start, int nbits);
+
+/**
+ * Count the clear bits in a bitmap.
+ *
+ * @param map the bitmap
+ * @param nbits the number of bits in the bitmap
+ * @return the number of clear bits
+ */
+extern int bitmap_count_zero(const uint64_t *map, int nbits);
+
+#endif /* BITMAP_H_ */
@@ -0,0 +1,131 @@
+/*
+ * file:        blkdev.c
+ * description: Generic request submission for block devices
+ */
+
+#include <stddef.h>
+
+#include "blkdev.h"
+
+/**
+ * Read consecutive blocks into scattered buffers, reading each
+ * buffer separately if the device has no readv operation.
+ *
+ * @param dev the block device
+ * @param first_blk the first block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if successful, or error status
+ */
+int blkdev_readv(struct blkdev *dev, int first_blk, const struct iovec *iov, int iovcnt)
+{
+    if (dev->ops->readv != NULL) {
+        return dev->ops->readv(dev, first_blk, iov, iovcnt);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        int nblks = iov[i].iov_len / BLOCK_SIZE;
+        int result = dev->ops->read(dev, first_blk, nblks, iov[i].iov_base);
+        if (result < 0) {
+            return result;
+        }
+        first_blk += nblks;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Write consecutive blocks from scattered buffers, writing each
+ * buffer separately if the device has no writev operation.
+ *
+ * @param dev the block device
+ * @param first_blk the first block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if successful, or error status
+ */
+int blkdev_writev(struct blkdev *dev, int first_blk, const struct iovec *iov, int iovcnt)
+{
+    if (dev->ops->writev != NULL) {
+        return dev->ops->writev(dev, first_blk, iov, iovcnt);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        int nblks = iov[i].iov_len / BLOCK_SIZE;
+        int result = dev->ops->write(dev, first_blk, nblks, iov[i].iov_base);
+        if (result < 0) {
+            return result;
+        }
+        first_blk += nblks;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Get the buffer for one block of a request.
+ *
+ * @param req the request
+ * @param i the block index within the request
+ * @return pointer to the block's data
+ */
+char *blkdev_req_block(struct blkdev_req *req, int i)
+{
+    if (req->iov == NULL) {
+        return (char *)req->buf + (size_t)i * BLOCK_SIZE;
+    }
+    size_t offset = (size_t)i * BLOCK_SIZE;
+    int j = 0;
+    while (offset >= req->iov[j].iov_len) {
+        offset -= req->iov[j++].iov_len;
+    }
+    return (char *)req->iov[j].iov_base + offset;
+}
+
+/**
+ * Submit requests to a block device, performing them
+ * synchronously if the device has no submit operation.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if submitted, or error status
+ */
+int blkdev_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    if (dev->ops->submit != NULL) {
+        return dev->ops->submit(dev, reqs, nreqs);
+    }
+    for (int i = 0; i < nreqs; i++) {
+        struct blkdev_req *req = &reqs[i];
+        if (req->iov != NULL) {
+            req->status = req->op == BLKDEV_READ
+                          ? blkdev_readv(dev, req->first_blk, req->iov, req->iovcnt)
+                          : blkdev_writev(dev, req->first_blk, req->iov, req->iovcnt);
+        } else if (req->op == BLKDEV_READ) {
+            req->status = dev->ops->read(dev, req->first_blk, req->num_blks, req->buf);
+        } else {
+            req->status = dev->ops->write(dev, req->first_blk, req->num_blks, req->buf);
+        }
+        req->done = 1;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Wait for submitted requests to complete.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or first error status
+ */
+int blkdev_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    if (dev->ops->complete != NULL) {
+        return dev->ops->complete(dev, reqs, nreqs);
+    }
+    for (int i = 0; i < nreqs; i++) {
+        if (reqs[i].status < 0) {
+            return reqs[i].status;
+        }
+    }
+    return SUCCESS;
+}
@@ -8,6 +8,8 @@
 #ifndef __BLKDEV_H__
 #define __BLKDEV_H__
 
+#include <sys/uio.h>
+
 /**  block device block size */
 enum {BLOCK_SIZE = 1024};
 
@@ -20,13 +22,94 @@ struct blkdev {
     void *private;				/* block device private state */
 };
 
-/** Operations on a block device */
+/** block device request operations */
+enum {BLKDEV_READ = 0, BLKDEV_WRITE = 1};
+
+/** Asynchronous block device request */
+struct blkdev_req {
+    int   op;					/* BLKDEV_READ or BLKDEV_WRITE */
+    int   first_blk;			/* first block number */
+    int   num_blks;				/* number of blocks */
+    void *buf;					/* data buffer */
+    const struct iovec *iov;	/* scatter-gather buffers if not NULL */
+    int   iovcnt;				/* number of iov buffers */
+    int   status;				/* operation status when done */
+    int   done;					/* set when request completes */
+};
+
+/**
+ * Operations on a block device. The readv and writev operations
+ * transfer consecutive blocks to or from scattered buffers; each
+ * buffer length is a multiple of the block size. The submit and
+ * complete operations queue requests that may complete in any order
+ * and wait until all of the given requests are done; requests and
+ * their buffers must remain valid until completed. These four
+ * operations are optional.
+ */
 struct blkdev_ops {
     int  (*num_blocks)(struct blkdev *dev);
     int  (*read)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
     int  (*write)(struct blkdev *dev, int first_blk, int num_blks, void *buf);
     int  (*flush)(struct blkdev *dev, int first_blk, int num_blks);
     void (*close)(struct blkdev *dev);
+    int  (*readv)(struct blkdev *dev, int first_blk, const struct iovec *iov, int iovcnt);
+    int  (*writev)(struct blkdev *dev, int first_blk, const struct iovec *iov, int iovcnt);
+    int  (*submit)(struct blkdev *dev, struct blkdev_req *reqs, int nreqs);
+    int  (*complete)(struct blkdev *dev, struct blkdev_req *reqs, int nreqs);
 };
 
+/**
+ * Read consecutive blocks into scattered buffers, reading each
+ * buffer separately if the device has no readv operation.
+ *
+ * @param dev the block device
+ * @param first_blk the first block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if successful, or error status
+ */
+extern int blkdev_readv(struct blkdev *dev, int first_blk, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write consecutive blocks from scattered buffers, writing each
+ * buffer separately if the device has no writev operation.
+ *
+ * @param dev the block device
+ * @param first_blk the first block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt the number of buffers
+ * @return SUCCESS if successful, or error status
+ */
+extern int blkdev_writev(struct blkdev *dev, int first_blk, const struct iovec *iov, int iovcnt);
+
+/**
+ * Get the buffer for one block of a request.
+ *
+ * @param req the request
+ * @param i the block index within the request
+ * @return pointer to the block's data
+ */
+extern char *blkdev_req_block(struct blkdev_req *req, int i);
+
+/**
+ * Submit requests to a block device, performing them
+ * synchronously if the device has no submit operation.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if submitted, or error status
+ */
+extern int blkdev_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs);
+
+/**
+ * Wait for submitted requests to complete.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or first error status
+ */
+extern int blkdev_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs);
+
 #endif
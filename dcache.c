@@ -0,0 +1,239 @@
+/*
+ * file:        dcache.c
+ * description: Directory entry cache for path name lookup
+ *
+ * Entries map a (directory inode, name) pair to the inode of the
+ * directory entry, or to 0 if the name is known not to exist. They
+ * are kept in a hash table keyed by directory and name, and on a
+ * doubly-linked list in least-recently-used order. The file system
+ * keeps the cache consistent by entering or removing names whenever
+ * it changes a directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fsx600.h"
+#include "dcache.h"
+
+/** a cached directory entry */
+struct dcache_entry {
+    int parent;                     // directory inode, or -1 if unused
+    int inum;                       // entry inode, or 0 if negative
+    struct dcache_entry *hnext;     // next entry in hash chain
+    struct dcache_entry *prev;      // previous entry in LRU list
+    struct dcache_entry *next;      // next entry in LRU list
+    char name[FS_FILENAME_SIZE];    // entry name
+};
+
+/** definition of directory entry cache */
+struct dcache {
+    int nentries;                   // number of entries
+    struct dcache_entry *entries;   // entry storage
+    struct dcache_entry **hash;     // hash table of entry chains
+    int hash_mask;                  // hash table size - 1
+    struct dcache_entry lru;        // LRU list head: next is most recent
+    pthread_mutex_t lock;           // protects all of the above
+};
+
+/**
+ * Get hash chain for a directory and name.
+ *
+ * @param dc the cache
+ * @param parent the directory inode
+ * @param name the entry name
+ * @return pointer to the head of the hash chain
+ */
+static struct dcache_entry **dcache_chain(struct dcache *dc, int parent, const char *name)
+{
+    /* FNV-1a over the name, seeded with the directory inode */
+    uint32_t h = 2166136261u ^ (uint32_t) parent;
+    for (const char *p = name; *p != '\0'; p++) {
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    }
+    return &dc->hash[h & dc->hash_mask];
+}
+
+/**
+ * Unlink an entry from the LRU list.
+ *
+ * @param e the entry
+ */
+static void lru_remove(struct dcache_entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+/**
+ * Link an entry at the most-recently-used end of the LRU list.
+ *
+ * @param dc the cache
+ * @param e the entry
+ */
+static void lru_push(struct dcache *dc, struct dcache_entry *e)
+{
+    e->next = dc->lru.next;
+    e->prev = &dc->lru;
+    dc->lru.next->prev = e;
+    dc->lru.next = e;
+}
+
+/**
+ * Link an entry at the least-recently-used end of the LRU list,
+ * so it is the next to be reused.
+ *
+ * @param dc the cache
+ * @param e the entry
+ */
+static void lru_push_tail(struct dcache *dc, struct dcache_entry *e)
+{
+    e->prev = dc->lru.prev;
+    e->next = &dc->lru;
+    dc->lru.prev->next = e;
+    dc->lru.prev = e;
+}
+
+/**
+ * Find an entry and make it the most recently used.
+ *
+ * @param dc the cache
+ * @param parent the directory inode
+ * @param name the entry name
+ * @return the entry or NULL if not cached
+ */
+static struct dcache_entry *dcache_find(struct dcache *dc, int parent, const char *name)
+{
+    for (struct dcache_entry *e = *dcache_chain(dc, parent, name); e != NULL; e = e->hnext) {
+        if (e->parent == parent && strcmp(e->name, name) == 0) {
+            lru_remove(e);
+            lru_push(dc, e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Remove an entry from its hash chain and make it the next
+ * entry to be reused.
+ *
+ * @param dc the cache
+ * @param e the entry
+ */
+static void dcache_unhash(struct dcache *dc, struct dcache_entry *e)
+{
+    for (struct dcache_entry **pp = dcache_chain(dc, e->parent, e->name); *pp != NULL; pp = &(*pp)->hnext) {
+        if (*pp == e) {
+            *pp = e->hnext;
+            break;
+        }
+    }
+    e->parent = -1;
+    lru_remove(e);
+    lru_push_tail(dc, e);
+}
+
+bool dcache_lookup(struct dcache *dc, int parent, const char *name, int *inum)
+{
+    pthread_mutex_lock(&dc->lock);
+    struct dcache_entry *e = dcache_find(dc, parent, name);
+    if (e != NULL) {
+        *inum = e->inum;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return e != NULL;
+}
+
+void dcache_enter(struct dcache *dc, int parent, const char *name, int inum)
+{
+    if (strlen(name) >= FS_FILENAME_SIZE) {
+        return;
+    }
+    pthread_mutex_lock(&dc->lock);
+    struct dcache_entry *e = dcache_find(dc, parent, name);
+    if (e == NULL) {
+        e = dc->lru.prev;
+        if (e->parent != -1) {
+            dcache_unhash(dc, e);
+        }
+        e->parent = parent;
+        strcpy(e->name, name);
+        struct dcache_entry **chain = dcache_chain(dc, parent, name);
+        e->hnext = *chain;
+        *chain = e;
+        lru_remove(e);
+        lru_push(dc, e);
+    }
+    e->inum = inum;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_remove(struct dcache *dc, int parent, const char *name)
+{
+    pthread_mutex_lock(&dc->lock);
+    struct dcache_entry *e = dcache_find(dc, parent, name);
+    if (e != NULL) {
+        dcache_unhash(dc, e);
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_purge(struct dcache *dc, int parent)
+{
+    pthread_mutex_lock(&dc->lock);
+    for (int i = 0; i < dc->nentries; i++) {
+        if (dc->entries[i].parent == parent) {
+            dcache_unhash(dc, &dc->entries[i]);
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+struct dcache *dcache_create(int nentries)
+{
+    struct dcache *dc = calloc(1, sizeof(*dc));
+    if (dc == NULL || nentries <= 0) {
+        free(dc);
+        return NULL;
+    }
+    pthread_mutex_init(&dc->lock, NULL);
+
+    /* hash table size is the next power of two */
+    int nhash = 1;
+    while (nhash < nentries) {
+        nhash <<= 1;
+    }
+    dc->hash = calloc(nhash, sizeof(*dc->hash));
+    dc->entries = malloc(nentries * sizeof(*dc->entries));
+    if (dc->hash == NULL || dc->entries == NULL) {
+        fprintf(stderr, "can't allocate %d entry directory cache\n", nentries);
+        dcache_free(dc);
+        return NULL;
+    }
+    dc->hash_mask = nhash - 1;
+    dc->nentries = nentries;
+
+    /* all entries start out unused on the LRU list */
+    dc->lru.next = dc->lru.prev = &dc->lru;
+    for (int i = 0; i < nentries; i++) {
+        dc->entries[i].parent = -1;
+        dc->entries[i].hnext = NULL;
+        lru_push(dc, &dc->entries[i]);
+    }
+    return dc;
+}
+
+void dcache_free(struct dcache *dc)
+{
+    if (dc == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&dc->lock);
+    free(dc->hash);
+    free(dc->entries);
+    free(dc);
+}
@@ -0,0 +1,72 @@
+/*
+ * file:        dcache.h
+ * description: Directory entry cache for path name lookup
+ */
+
+#ifndef DCACHE_H_
+#define DCACHE_H_
+
+#include <stdbool.h>
+
+/** default cache size in entries */
+enum {DCACHE_DEFAULT_ENTRIES = 4096};
+
+struct dcache;
+
+/**
+ * Create a directory entry cache mapping (directory inode, name)
+ * to the inode of the entry. Entries may be negative, recording
+ * that a name is not present in a directory.
+ *
+ * @param nentries the cache size in entries
+ * @return the cache, or NULL if cannot allocate the cache
+ */
+extern struct dcache *dcache_create(int nentries);
+
+/**
+ * Free a directory entry cache.
+ *
+ * @param dc the cache
+ */
+extern void dcache_free(struct dcache *dc);
+
+/**
+ * Look up a name in a directory.
+ *
+ * @param dc the cache
+ * @param parent the directory inode
+ * @param name the entry name
+ * @param inum pointer to space for the entry inode, 0 if negative
+ * @return true if the name was found in the cache
+ */
+extern bool dcache_lookup(struct dcache *dc, int parent, const char *name, int *inum);
+
+/**
+ * Enter a name in a directory, replacing any existing entry.
+ *
+ * @param dc the cache
+ * @param parent the directory inode
+ * @param name the entry name
+ * @param inum the entry inode, or 0 for a negative entry
+ */
+extern void dcache_enter(struct dcache *dc, int parent, const char *name, int inum);
+
+/**
+ * Remove a name in a directory from the cache.
+ *
+ * @param dc the cache
+ * @param parent the directory inode
+ * @param name the entry name
+ */
+extern void dcache_remove(struct dcache *dc, int parent, const char *name);
+
+/**
+ * Remove all entries for names in a directory, which is
+ * required when a directory inode is freed.
+ *
+ * @param dc the cache
+ * @param parent the directory inode
+ */
+extern void dcache_purge(struct dcache *dc, int parent);
+
+#endif /* DCACHE_H_ */
@@ -25,6 +25,28 @@ struct fs_dirent {
     char name[FS_FILENAME_SIZE];/* with trailing NUL */
 };								/* total 32 bytes */
 
+/**
+ * Superblock flags
+ */
+enum {
+	FS_SUPER_COUNTS = 0x1		/* free_blocks, free_inodes written at unmount */
+};
+
+/**
+ * Format features - an image using a feature can only be
+ * mounted by code that supports it.
+ */
+enum {
+	FS_FEATURE_HTREE = 0x1,		/* directories may have a hashed index */
+	FS_FEATURE_JOURNAL = 0x2,	/* metadata is written through a journal */
+	FS_FEATURE_EXTENTS = 0x4,	/* inodes may be mapped by extents */
+	FS_FEATURE_GROUPS = 0x8,	/* disk is divided into block groups */
+	FS_FEATURE_UNWRITTEN = 0x10,/* extents may be marked unwritten */
+	FS_FEATURES_SUPPORTED = FS_FEATURE_HTREE | FS_FEATURE_JOURNAL |
+							FS_FEATURE_EXTENTS | FS_FEATURE_GROUPS |
+							FS_FEATURE_UNWRITTEN
+};
+
 /**
  * Superblock - holds file system parameters.
  */
@@ -35,15 +57,82 @@ struct fs_super {
     uint32_t block_map_sz;		/* block map size in blocks */
     uint32_t num_blocks;		/* total blocks, including SB, bitmaps, inodes */
     uint32_t root_inode;		/* always inode 1 */
+    uint32_t flags;				/* FS_SUPER_* flags */
+    uint32_t free_blocks;		/* free blocks if FS_SUPER_COUNTS */
+    uint32_t free_inodes;		/* free inodes if FS_SUPER_COUNTS */
+    uint32_t features;			/* FS_FEATURE_* format features */
+    uint32_t journal_start;		/* first journal block if FS_FEATURE_JOURNAL */
+    uint32_t journal_blks;		/* journal size in blocks */
+    uint32_t group_blks;		/* blocks per group if FS_FEATURE_GROUPS */
+    uint32_t group_inodes;		/* inodes per group if FS_FEATURE_GROUPS */
+    uint32_t blk_rotor;			/* next block allocation search, saved at unmount */
+    uint32_t inode_rotor;		/* next inode allocation search, or 0 */
 
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 16 * sizeof(uint32_t)]; 
+};								/* total FS_BLOCK_SIZE bytes */
+
+/**
+ * Block groups. With FS_FEATURE_GROUPS, the disk is divided into
+ * groups of group_blks blocks, the last of which may be shorter.
+ * Each group holds its slice of the block map (group_blks / 8192
+ * blocks), then its slice of the inode map (group_inodes / 8192
+ * blocks), then its group_inodes inodes, then data blocks. Group 0
+ * starts after the superblock and the group table, which holds a
+ * summary for each group. The map slices and inode slices are
+ * numbered across the groups in order, so the superblock sizes
+ * are totals. Without block groups, the maps and inodes follow the
+ * superblock in turn.
+ */
+struct fs_group {
+    uint32_t free_blocks;		/* free blocks if FS_SUPER_COUNTS */
+    uint32_t free_inodes;		/* free inodes if FS_SUPER_COUNTS */
+};
+
+enum {GROUPS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_group)};
+
+/**
+ * Extent tree. An FS_INODE_EXTENTS inode maps its blocks with a tree
+ * of extents whose root is held in the inode. In a leaf node
+ * (depth == 0), each entry maps len file blocks from lblk to the
+ * disk blocks from start. In an index node, each entry points to
+ * the child node in disk block start, which holds the entries from
+ * lblk up to the next entry's lblk; len is 0. Entries are sorted
+ * by lblk and do not overlap. The blocks of an unwritten extent are
+ * allocated but read as zeros; the flag is cleared when they are
+ * first written.
+ */
+struct fs_extent {
+    uint32_t lblk;				/* first file block */
+    uint32_t start;				/* first disk block, or child node */
+    uint32_t len : 31;			/* number of blocks; 0 in index nodes */
+    uint32_t unwritten : 1;		/* blocks not yet written, if FS_FEATURE_UNWRITTEN */
+};								/* total 12 bytes */
+
+struct fs_extent_header {
+    uint16_t count;				/* entries in use */
+    uint16_t depth;				/* levels of nodes below this one */
+};
+
+enum {
+	N_INODE_EXTENTS = 2,		/* entries in the root, in the inode */
+	EXTENTS_PER_BLK = (FS_BLOCK_SIZE - sizeof(struct fs_extent_header)) /
+			sizeof(struct fs_extent)
+};
+struct fs_extent_node {
+    struct fs_extent_header hdr;
+    struct fs_extent extents[EXTENTS_PER_BLK];
 };								/* total FS_BLOCK_SIZE bytes */
 
 /**
  * Inode - holds file entry information
  */
 enum {N_DIRECT = 6 };			/* number direct entries */
+enum {
+	FS_INODE_HTREE = 0x1,		/* directory has a hashed index */
+	FS_INODE_EXTENTS = 0x2,		/* blocks are mapped by an extent tree */
+	FS_INODE_UNWRITTEN = 0x4	/* extent tree may have unwritten extents */
+};
 struct fs_inode {
     uint16_t uid;				/* user ID of file owner */
     uint16_t gid;				/* group ID of file owner */
@@ -51,10 +140,20 @@ struct fs_inode {
     uint32_t ctime;				/* creation time */
     uint32_t mtime;				/* last modification time */
     int32_t size;				/* size in bytes */
-    uint32_t direct[N_DIRECT];	/* direct block pointers */
-    uint32_t indir_1;			/* single indirect block pointer */
-    uint32_t indir_2;			/* double indirect block pointer */
-    uint32_t pad[3];            /* 64 bytes per inode */
+    union {
+        struct {
+            uint32_t direct[N_DIRECT];	/* direct block pointers */
+            uint32_t indir_1;	/* single indirect block pointer */
+            uint32_t indir_2;	/* double indirect block pointer */
+        };
+        struct {				/* if FS_INODE_EXTENTS */
+            struct fs_extent_header ext_hdr;	/* extent tree root */
+            struct fs_extent extents[N_INODE_EXTENTS];
+            uint32_t ext_pad;
+        };
+    };
+    uint32_t flags;				/* FS_INODE_* flags */
+    uint32_t pad[2];            /* 64 bytes per inode */
 };								/* total 64 bytes */
 
 /**
@@ -71,6 +170,66 @@ enum {
 	BITS_PER_BLK = FS_BLOCK_SIZE * 8
 };
 
+/**
+ * Hashed directory index. Block 0 of an FS_INODE_HTREE directory
+ * is the index root. Each index entry covers names whose hash is
+ * at least its hash and less than the next entry's hash; entry 0
+ * always has hash 0. If the root has levels == 0, entries point to
+ * leaf blocks, which hold fs_dirent arrays; if levels == 1, they
+ * point to index blocks, which point to leaf blocks. Block numbers
+ * are file blocks within the directory.
+ */
+struct fs_dx_entry {
+    uint32_t hash;				/* lowest name hash covered */
+    uint32_t block;				/* directory file block */
+};
+
+enum {DX_ENTRIES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_dx_entry) - 1};
+struct fs_dx_node {
+    uint16_t count;				/* entries in use */
+    uint16_t levels;			/* root only: index levels below root */
+    uint32_t pad;
+    struct fs_dx_entry entries[DX_ENTRIES_PER_BLK];
+};								/* total FS_BLOCK_SIZE bytes */
+
+/**
+ * Metadata journal. The journal_blks blocks from journal_start are
+ * allocated in the block map. Journal block 0 holds the journal
+ * superblock; blocks 1 to journal_blks - 1 are a circular log of
+ * records. A record is a descriptor block followed by a copy of each
+ * block it lists that is not a revoke. A transaction is one or more
+ * consecutive records with the same sequence number, the last with
+ * FS_JOURNAL_COMMIT set. A record that does not fit before the end
+ * of the log starts at log block 1 instead. Replay writes the blocks
+ * of every complete transaction from head to their home locations,
+ * except those revoked by a later transaction.
+ */
+enum {
+	FS_JOURNAL_MAGIC = 0x4a524e4c,		/* journal superblock magic */
+	FS_JOURNAL_DESC_MAGIC = 0x4a444553,	/* descriptor block magic */
+	FS_JOURNAL_COMMIT = 0x1,			/* descriptor flag: ends transaction */
+	FS_JOURNAL_REVOKE = 0x40000000		/* block entry flag: revoke, no data */
+};
+
+struct fs_journal_super {
+    uint32_t magic;				/* FS_JOURNAL_MAGIC */
+    uint32_t seq;				/* sequence number of first transaction */
+    uint32_t head;				/* log block of first transaction */
+
+    /* pad out to an entire block */
+    char pad[FS_BLOCK_SIZE - 3 * sizeof(uint32_t)];
+};								/* total FS_BLOCK_SIZE bytes */
+
+enum {FS_JOURNAL_DESC_ENTRIES = FS_BLOCK_SIZE / sizeof(uint32_t) - 5};
+struct fs_journal_desc {
+    uint32_t magic;				/* FS_JOURNAL_DESC_MAGIC */
+    uint32_t seq;				/* transaction sequence number */
+    uint32_t flags;				/* FS_JOURNAL_COMMIT */
+    uint32_t count;				/* number of block entries */
+    uint32_t checksum;			/* FNV-1a of record, with this field 0 */
+    uint32_t blocks[FS_JOURNAL_DESC_ENTRIES]; /* home block numbers */
+};								/* total FS_BLOCK_SIZE bytes */
+
 #endif
 
 
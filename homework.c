@@ -14,6 +14,7 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fuse.h>
 #include <fcntl.h>
@@ -21,47 +22,195 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "fsx600.h"
 #include "blkdev.h"
+#include "bitmap.h"
+#include "dcache.h"
+#include "bcache.h"
+#include "journal.h"
 
 
 //extern int homework_part;       /* set by '-part n' command-line option */
+extern int journal_size;        /* set by '-journal n' command-line option */
+extern int delalloc_mode;       /* set by '-delalloc' command-line option */
+extern int extents_mode;        /* set by '-extents' command-line option */
 
 /* 
  * disk access - the global variable 'disk' points to a blkdev
- * structure which has been initialized to access the image file.
+ * structure which has been initialized to access the image file
+ * through the block cache (see bcache.h).
  *
  * NOTE - blkdev access is in terms of 1024-byte blocks
  */
 extern struct blkdev *disk;
 
-/* by defining bitmaps as 'fd_set' pointers, you can use existing
- * macros to handle them. 
- *   FD_ISSET(##, inode_map);
- *   FD_CLR(##, block_map);
- *   FD_SET(##, block_map);
+/* bitmaps are arrays of 64-bit words handled by bitmap.h:
+ *   bitmap_test(inode_map, ##);
+ *   bitmap_clear(block_map, ##);
+ *   bitmap_set(block_map, ##);
  */
 
 /** pointer to inode bitmap to determine free inodes */
-static fd_set *inode_map;
+static uint64_t *inode_map;
+/** first inode map block, within each group if there are groups */
 static int     inode_map_base;
 
 /** pointer to inode blocks */
 static struct fs_inode *inodes;
 /** number of inodes from superblock */
 static int   n_inodes;
-/** number of first inode block */
+/** first inode block, within each group if there are groups */
 static int   inode_base;
 
 /** pointer to block bitmap to determine free blocks */
-fd_set *block_map;
-/** number of first data block */
+uint64_t *block_map;
+/** first block map block, within each group if there are groups */
 static int     block_map_base;
 
+/** block groups; without FS_FEATURE_GROUPS, one group holds the disk */
+static int   n_groups;
+static int   group_blks;            // blocks per group
+static int   group_inodes;          // inodes per group
+static int   group0_start;          // first block of group 0
+static int   group_table_sz;        // group table blocks, after the superblock
+
+/** blocks of the inode map, block map and inodes in each group */
+static int   group_imap_blks;
+static int   group_bmap_blks;
+static int   group_inode_blks;
+
+/** per-group free counts, kept by the allocators */
+static struct fs_group *groups;
+
+/** number of blocks holding the superblock, group table, maps and inodes */
+static int   n_meta_blks;
+
+/** bitmap of blocks allocated to files but not yet written, including
+ *  mapped blocks of unwritten extents; they read as zeros */
+static uint64_t *uninit_map;
+
+/** blocks in uninit_map were written since the last metadata flush; they
+ *  must reach the disk before the metadata that makes them reachable */
+static bool uninit_written;
+
 /** number of available blocks from superblock */
 static int   n_blocks;
 
+/** cache of directory entries for path lookup */
+static struct dcache *dcache;
+
+/** number of file blocks mapped ahead for an open file */
+enum {FILE_MAP_BLKS = 64};
+
+/** readahead window limits in blocks, and requests per readahead */
+enum {RA_MIN_BLKS = 4, RA_MAX_BLKS = 128, RA_MAX_REQS = 16};
+
+/** an open file, indexed by fi->fh */
+struct fs_file {
+    int inum;                       // inode number, or -1 if slot unused
+    int map_lblk;                   // first file block of mapping window
+    int map_nblks;                  // number of blocks in mapping window
+    uint32_t map[FILE_MAP_BLKS];    // disk blocks of mapping window
+    off_t next_offset;              // offset following last read or write
+    int ra_blks;                    // readahead window, 0 if not sequential
+    int ra_start;                   // first file block read ahead
+    int ra_end;                     // file block following blocks read ahead
+    int ra_nreqs;                   // readahead requests in flight
+    struct blkdev_req ra_reqs[RA_MAX_REQS]; // readahead requests
+    char *ra_buf;                   // readahead buffer, RA_MAX_BLKS blocks
+    bool written;                   // file written through this handle
+};
+
+/** open file table; each open file is allocated separately, since
+ *  readahead in flight points into it while the table grows */
+static struct fs_file **files;
+static int n_files;
+
+/** true if readahead is enabled, which needs a block cache to read into */
+static bool ra_enabled;
+
+/** readahead counters: blocks read ahead, and blocks later read from them */
+static long ra_prefetched;
+static long ra_hits;
+
+/** blocks buffered per file for delayed allocation, and files buffered */
+enum {DELALLOC_MAX_BLKS = 256, DELALLOC_INODES = 32};
+
+/** file blocks written past the allocated part of a file and not yet
+ *  allocated; space for them is reserved in the free count */
+struct fs_delalloc {
+    int inum;                       // inode number, or 0 if unused
+    int lblk;                       // first file block buffered
+    int nblks;                      // number of blocks buffered
+    char *data;                     // DELALLOC_MAX_BLKS blocks, or NULL
+};
+
+/** delayed allocation buffers, indexed by inode number modulo DELALLOC_INODES */
+static struct fs_delalloc delalloc[DELALLOC_INODES];
+
+/** -EIO if buffered blocks could not be allocated, until fs_sync reports it */
+static int delalloc_status;
+
+/** number of inodes with cached block maps */
+enum {BMAP_CACHE_INODES = 32};
+
+/** cached copies of an inode's pointer blocks, loaded on first use */
+struct fs_bmap_cache {
+    int inum;                       // inode number, or 0 if unused
+    uint32_t *indir_1;              // single indirect block, or NULL
+    uint32_t *indir_2;              // double indirect block, or NULL
+    uint32_t *indir_2_blks[PTRS_PER_BLK]; // blocks under indir_2, or NULL
+};
+
+/** block map caches, indexed by inode number modulo BMAP_CACHE_INODES */
+static struct fs_bmap_cache bmap_cache[BMAP_CACHE_INODES];
+
+/** copy of the superblock, written back at unmount */
+static struct fs_super super;
+
+/** free block and inode counts, kept by the allocators */
+static int   n_free_blks;
+static int   n_free_inodes;
+
+/** blocks reserved for a file, doubling from RESV_MIN_BLKS to RESV_MAX_BLKS */
+enum {RESV_INODES = 32, RESV_MIN_BLKS = 16, RESV_MAX_BLKS = 256};
+
+/** free blocks held for a file's next allocation, so files written
+ *  at the same time are not interleaved */
+struct fs_resv {
+    int inum;                       // inode number, or 0 if unused
+    int start;                      // first reserved block
+    int len;                        // number of reserved blocks
+    int window;                     // blocks reserved last time
+};
+
+/** reservations, indexed by inode number modulo RESV_INODES */
+static struct fs_resv resv[RESV_INODES];
+
+/** free runs examined for one of the wanted length before settling
+ *  for the longest */
+enum {FIND_RUN_MAX_SCAN = 64};
+
+/** next-fit cursors: allocation searches start after the last one;
+ *  saved in the superblock at unmount */
+static int blk_rotor;
+static int inode_rotor = 2;
+
+/** block to allocate a new file's first block near, by inode number;
+ *  the parent directory's first block, or 0 if not known */
+static uint32_t *blk_goal;
+
+/** contiguous blocks allocated for a write and not yet mapped */
+struct blk_run {
+    int inum;                       // inode being written
+    int want;                       // blocks the write still needs
+    int goal;                       // block to allocate near, or 0
+    int next;                       // next block of the run
+    int left;                       // blocks left in the run
+};
+
 /** number of root inode from superblock */
 static int   root_inode;
 
@@ -71,35 +220,304 @@ static void **dirty;
 /** length of dirty array -- optional */
 static int    dirty_len;
 
-/** total size of direct blocks */
-static int DIR_SIZE = BLOCK_SIZE * N_DIRECT;
-static int INDIR1_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
-static int INDIR2_SIZE = (BLOCK_SIZE / sizeof(uint32_t)) * (BLOCK_SIZE / sizeof(uint32_t)) * BLOCK_SIZE;
+/** number of dirty metadata blocks */
+static int    n_dirty;
 
-/* Suggested functions to implement -- you are free to ignore these
- * and implement your own instead
+/** seconds between write-backs of dirty metadata */
+enum {METADATA_FLUSH_SECS = 5};
+
+/** time of last metadata write-back */
+static time_t last_flush;
+
+/** journal blocks to leave for the metadata blocks of one operation */
+enum {JOURNAL_OP_BLKS = 16};
+
+/** metadata journal, or NULL if metadata is written in place */
+static struct journal *journal;
+
+/**
+ * Group commit of sync requests: each request takes the next ticket,
+ * and one requester at a time flushes the disk for every ticket taken
+ * before it started, while later requesters wait for the next flush.
+ */
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long sync_ticket;       // last ticket taken
+static unsigned long sync_done;         // last ticket flushed
+static bool sync_busy;                  // a flush is in progress
+static int sync_status;                 // status of last flush
+
+/**
+ * FUSE calls the handlers from several threads. Each handler holds
+ * fs_lock while it runs, so it sees and changes file system state
+ * alone; fsync and fsyncdir take it only to flush metadata, so their
+ * callers can join a group commit while other handlers run.
+ */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** number of file blocks mapped by direct, indirect 1 and indirect 2 pointers */
+static int DIR_BLKS = N_DIRECT;
+static int INDIR1_BLKS = PTRS_PER_BLK;
+static int INDIR2_BLKS = PTRS_PER_BLK * PTRS_PER_BLK;
+
+/** limits on requests, buffer segments and bounce buffers in an I/O batch */
+enum {IO_BATCH_MAX = 64, IO_BATCH_IOV = 256, IO_BATCH_BOUNCE = 16};
+
+/**
+ * Batch of block requests that are submitted to the disk together
+ * and reaped together. Blocks queued at consecutive disk addresses
+ * are merged into one vectored request, so data moves directly
+ * between the disk and the caller's buffer. A partial block goes
+ * through a bounce buffer, which for a read is copied to its
+ * destination when the batch completes.
  */
+struct io_batch {
+    int n;                                  /* number of queued requests */
+    struct blkdev_req reqs[IO_BATCH_MAX];   /* queued requests */
+    int niov;                               /* number of buffer segments */
+    struct iovec iov[IO_BATCH_IOV];         /* request buffer segments */
+    int nbounce;                            /* number of bounce buffers */
+    struct {
+        char *buf;                          /* bounce buffer */
+        char *copy_to;                      /* partial read destination, or NULL */
+        size_t offset;                      /* offset of partial read in block */
+        size_t len;                         /* length of partial read */
+    } bounce[IO_BATCH_BOUNCE];
+};
 
 /**
- * Find inode for existing directory entry.
+ * Submit all queued requests of a batch and wait for them.
  *
- * @param fs_dirent ptr to first dirent in directory
- * @param name the name of the directory entry
- * @return the entry inode, or 0 if not found.
+ * @param b the batch
  */
-static int find_in_dir(struct fs_dirent *de, char *name)
+static void batch_flush(struct io_batch *b)
 {
-    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        //found, return its inode
-        if (de[i].valid && strcmp(de[i].name, name) == 0) {
-            return de[i].inode;
+    if (b->n > 0) {
+        if (blkdev_submit(disk, b->reqs, b->n) < 0) exit(1);
+        if (blkdev_complete(disk, b->reqs, b->n) < 0) exit(1);
+    }
+    for (int i = 0; i < b->nbounce; i++) {
+        if (b->bounce[i].copy_to) {
+            memcpy(b->bounce[i].copy_to, b->bounce[i].buf + b->bounce[i].offset, b->bounce[i].len);
         }
+        free(b->bounce[i].buf);
     }
-    return 0;
+    b->n = b->niov = b->nbounce = 0;
+}
+
+/**
+ * Queue a transfer of consecutive blocks on a batch, merging it into
+ * the last request if it starts at the next block on disk. Flushes
+ * the batch first if it is full.
+ *
+ * @param b the batch
+ * @param op BLKDEV_READ or BLKDEV_WRITE
+ * @param blk_num the first block number
+ * @param num_blks the number of blocks
+ * @param buf the buffer for the blocks
+ */
+static void batch_add_run(struct io_batch *b, int op, int blk_num, int num_blks, char *buf)
+{
+    size_t len = (size_t) num_blks * BLOCK_SIZE;
+    if (b->n > 0) {
+        struct blkdev_req *last = &b->reqs[b->n - 1];
+        struct iovec *v = &b->iov[b->niov - 1];
+        if (last->op == op && last->first_blk + last->num_blks == blk_num) {
+            if ((char*)v->iov_base + v->iov_len == buf) {
+                v->iov_len += len;
+                last->num_blks += num_blks;
+                return;
+            }
+            if (b->niov < IO_BATCH_IOV) {
+                b->iov[b->niov].iov_base = buf;
+                b->iov[b->niov++].iov_len = len;
+                last->iovcnt++;
+                last->num_blks += num_blks;
+                return;
+            }
+        }
+    }
+    if (b->n == IO_BATCH_MAX || b->niov == IO_BATCH_IOV) batch_flush(b);
+
+    struct iovec *v = &b->iov[b->niov++];
+    v->iov_base = buf;
+    v->iov_len = len;
+    struct blkdev_req *req = &b->reqs[b->n++];
+    req->op = op;
+    req->first_blk = blk_num;
+    req->num_blks = num_blks;
+    req->buf = NULL;
+    req->iov = v;
+    req->iovcnt = 1;
+    req->status = SUCCESS;
+    req->done = 0;
+}
+
+/**
+ * Queue a single block transfer on a batch.
+ *
+ * @param b the batch
+ * @param op BLKDEV_READ or BLKDEV_WRITE
+ * @param blk_num the block number
+ * @param buf the block buffer
+ */
+static void batch_add(struct io_batch *b, int op, int blk_num, char *buf)
+{
+    batch_add_run(b, op, blk_num, 1, buf);
 }
 
 /**
- * Look up a single directory entry in a directory.
+ * Get a bounce buffer for a partial block transfer. The buffer is
+ * freed when the batch completes. Flushes the batch first if needed
+ * so that queuing the block transfer will not flush it again.
+ *
+ * @param b the batch
+ * @param copy_to destination for a partial read, or NULL
+ * @param offset offset of partial read in block
+ * @param len length of partial read
+ * @return the bounce buffer
+ */
+static char *batch_bounce(struct io_batch *b, char *copy_to, size_t offset, size_t len)
+{
+    if (b->nbounce == IO_BATCH_BOUNCE || b->n == IO_BATCH_MAX || b->niov == IO_BATCH_IOV) {
+        batch_flush(b);
+    }
+    char *buf = malloc(BLOCK_SIZE);
+    b->bounce[b->nbounce].buf = buf;
+    b->bounce[b->nbounce].copy_to = copy_to;
+    b->bounce[b->nbounce].offset = offset;
+    b->bounce[b->nbounce++].len = len;
+    return buf;
+}
+
+/**
+ * Allocate an open file table entry for an inode.
+ *
+ * @param inum the inode number
+ * @return the file handle
+ */
+static int fs_file_alloc(int inum)
+{
+    int fh;
+    for (fh = 0; fh < n_files && files[fh]->inum >= 0; fh++)
+        ;
+    if (fh == n_files) {
+        int n = n_files == 0 ? 16 : 2 * n_files;
+        files = realloc(files, n * sizeof(*files));
+        if (files == NULL) exit(1);
+        for (int i = n_files; i < n; i++) {
+            if ((files[i] = malloc(sizeof(struct fs_file))) == NULL) exit(1);
+            files[i]->inum = -1;
+        }
+        n_files = n;
+    }
+    memset(files[fh], 0, sizeof(*files[fh]));
+    files[fh]->inum = inum;
+    return fh;
+}
+
+/**
+ * Get the open file table entry for a fuse file handle.
+ *
+ * @param fi the fuse file info, or NULL
+ * @return the open file, or NULL if fi does not hold a valid handle
+ */
+static struct fs_file *fs_file_get(struct fuse_file_info *fi)
+{
+    if (fi == NULL || fi->fh >= (uint64_t) n_files || files[fi->fh]->inum < 0) {
+        return NULL;
+    }
+    return files[fi->fh];
+}
+
+/**
+ * Wait for readahead in flight on an open file. The data goes
+ * into the block cache as the requests complete.
+ *
+ * @param f the open file
+ */
+static void fs_file_ra_wait(struct fs_file *f)
+{
+    if (f->ra_nreqs > 0) {
+        blkdev_complete(disk, f->ra_reqs, f->ra_nreqs);
+        f->ra_nreqs = 0;
+    }
+}
+
+/**
+ * Wait for readahead in flight on all open files for an inode,
+ * so it cannot complete after the file's blocks are changed.
+ *
+ * @param inum the inode number
+ */
+static void fs_file_ra_wait_inode(int inum)
+{
+    for (int i = 0; i < n_files; i++) {
+        if (files[i]->inum == inum) {
+            fs_file_ra_wait(files[i]);
+        }
+    }
+}
+
+/**
+ * Discard cached block mappings and readahead state of open files
+ * for an inode whose blocks have been freed.
+ *
+ * @param inum the inode number
+ */
+static void fs_file_invalidate(int inum)
+{
+    for (int i = 0; i < n_files; i++) {
+        if (files[i]->inum == inum) {
+            fs_file_ra_wait(files[i]);
+            files[i]->map_nblks = 0;
+            files[i]->ra_start = files[i]->ra_end = 0;
+        }
+    }
+}
+
+/**
+ * Get readahead counters.
+ *
+ * @param prefetched pointer to space for the number of blocks read ahead
+ * @param hits pointer to space for the number of blocks read that
+ *   had been read ahead
+ * @return true if readahead is enabled
+ */
+bool fs_readahead_stats(long *prefetched, long *hits)
+{
+    *prefetched = ra_prefetched;
+    *hits = ra_hits;
+    return ra_enabled;
+}
+
+/**
+ * Discard the cached block map of an inode whose pointer blocks
+ * have been freed.
+ *
+ * @param inum the inode number
+ */
+static void bmap_cache_drop(int inum)
+{
+    struct fs_bmap_cache *bc = &bmap_cache[inum % BMAP_CACHE_INODES];
+    if (bc->inum != inum) return;
+    free(bc->indir_1);
+    free(bc->indir_2);
+    for (int i = 0; i < PTRS_PER_BLK; i++) {
+        free(bc->indir_2_blks[i]);
+    }
+    memset(bc, 0, sizeof(*bc));
+}
+
+/* Suggested functions to implement -- you are free to ignore these
+ * and implement your own instead
+ */
+
+static bool dir_find(int dir, const char *name, struct fs_dirent *de);
+
+/**
+ * Look up a single directory entry in a directory, using the
+ * directory entry cache and reading the directory on a miss.
  *
  * Errors
  *   -EIO     - error reading block
@@ -109,13 +527,12 @@ static int find_in_dir(struct fs_dirent *de, char *name)
  */
 static int lookup(int inum, char *name)
 {
-    //get corresponding directory
-    struct fs_inode cur_dir = inodes[inum];
-    //init buff entries
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, cur_dir.direct[0], 1, &entries) < 0) exit(1);
-    int inode = find_in_dir(entries, name);
+    int inode;
+    if (!dcache_lookup(dcache, inum, name, &inode)) {
+        struct fs_dirent de;
+        inode = dir_find(inum, name, &de) ? de.inode : 0;
+        dcache_enter(dcache, inum, name, inode);
+    }
     return inode == 0 ? -ENOENT : inode;
 }
 
@@ -139,18 +556,22 @@ static int parse(char *path, char *names[], int nnames)
     int count = 0;
     char *token = strtok(_path, "/");
     while (token != NULL) {
-        if (strlen(token) > FS_FILENAME_SIZE - 1) return -EINVAL;
+        if (strlen(token) > FS_FILENAME_SIZE - 1) {
+            free(_path);
+            return -EINVAL;
+        }
         if (strcmp(token, "..") == 0 && count > 0) count--;
         else if (strcmp(token, ".") != 0) {
             if (names != NULL && count < nnames) {
-                names[count] = (char*)malloc(sizeof(char*));
-                memset(names[count], 0, sizeof(char*));
+                names[count] = (char*)malloc(FS_FILENAME_SIZE);
+                memset(names[count], 0, FS_FILENAME_SIZE);
                 strcpy(names[count], token);
             }
             count++;
         }
         token = strtok(NULL, "/");
     }
+    free(_path);
     //if the number of names in the path exceed the maximum
     if (nnames != 0 && count > nnames) return -1;
 	return count;
@@ -208,6 +629,21 @@ static int translate(char *path)
     return inode_idx;
 }
 
+/**
+ * Return inode number for a constant path, using a
+ * temporary copy of the path.
+ *
+ * @param path the file path
+ * @return inode of path node or error
+ */
+static int translate_path(const char *path)
+{
+    char *_path = strdup(path);
+    int inode_idx = translate(_path);
+    free(_path);
+    return inode_idx;
+}
+
 /**
  *  Return inode number for path to specified file
  *  or directory, and a leaf name that may not yet
@@ -253,6 +689,64 @@ static int translate_1(char *path, char *leaf)
     return inode_idx;
 }
 
+/**
+ * Mark a metadata block as dirty.
+ *
+ * @param blkno the block number
+ * @param buf the in-memory copy of the block
+ */
+static void mark_dirty(int blkno, void *buf)
+{
+    if (dirty[blkno] == NULL) n_dirty++;
+    dirty[blkno] = buf;
+}
+
+/**
+ * Get the first block of a block group.
+ *
+ * @param g the group number
+ * @return the block number
+ */
+static int group_start(int g)
+{
+    return g == 0 ? group0_start : g * group_blks;
+}
+
+/**
+ * Get the disk block holding a block of the inode map, block map or
+ * inode table, which each group holds a slice of.
+ *
+ * @param base the first block of the region within a group
+ * @param per_group the blocks of the region in each group
+ * @param k the block of the region
+ * @return the block number
+ */
+static int meta_blk(int base, int per_group, int k)
+{
+    return group_start(k / per_group) + base + k % per_group;
+}
+
+/**
+ * Read the inode map, block map or inode table, one slice per group.
+ *
+ * @param base the first block of the region within a group
+ * @param per_group the blocks of the region in each group
+ * @param nblks the blocks of the region in all groups
+ * @return the region, which the caller frees
+ */
+static void *meta_region_read(int base, int per_group, int nblks)
+{
+    char *buf = malloc(nblks * FS_BLOCK_SIZE);
+    if (buf == NULL) exit(1);
+    for (int k = 0; k < nblks; k += per_group) {
+        int n = nblks - k < per_group ? nblks - k : per_group;
+        if (disk->ops->read(disk, meta_blk(base, per_group, k), n, buf + k * FS_BLOCK_SIZE) < 0) {
+            exit(1);
+        }
+    }
+    return buf;
+}
+
 /**
  * Mark a inode as dirty.
  *
@@ -262,54 +756,449 @@ static void mark_inode(struct fs_inode *in)
 {
     int inum = in - inodes;
     int blk = inum / INODES_PER_BLK;
-    dirty[inode_base + blk] = (void*)inodes + blk * FS_BLOCK_SIZE;
+    mark_dirty(meta_blk(inode_base, group_inode_blks, blk), (void*)inodes + blk * FS_BLOCK_SIZE);
 }
 
 /**
- * Flush dirty metadata blocks to disk.
+ * Mark the inode map block holding an inode's bit as dirty.
+ *
+ * @param inum the inode number
+ */
+static void mark_inode_map(int inum)
+{
+    int blk = inum / BITS_PER_BLK;
+    mark_dirty(meta_blk(inode_map_base, group_imap_blks, blk),
+               (char*)inode_map + blk * FS_BLOCK_SIZE);
+}
+
+/**
+ * Mark the block map block holding a block's bit as dirty.
+ *
+ * @param blkno the block number
+ */
+static void mark_block_map(int blkno)
+{
+    int blk = blkno / BITS_PER_BLK;
+    mark_dirty(meta_blk(block_map_base, group_bmap_blks, blk),
+               (char*)block_map + blk * FS_BLOCK_SIZE);
+}
+
+/**
+ * Read a directory or pointer block, which may only be up to date
+ * in the journal.
+ *
+ * @param blkno the block number
+ * @param buf the buffer for the block contents
+ */
+static void meta_read(int blkno, void *buf)
+{
+    if (journal != NULL && journal_read(journal, blkno, buf)) return;
+    if (disk->ops->read(disk, blkno, 1, buf) < 0) exit(1);
+}
+
+/**
+ * Write a directory or pointer block, logging it in the
+ * journal if there is one instead of writing it in place.
+ *
+ * @param blkno the block number
+ * @param buf the block contents
+ */
+static void meta_write(int blkno, const void *buf)
+{
+    if (journal != NULL) {
+        if (journal_log(journal, blkno, buf) < 0) exit(1);
+    } else if (disk->ops->write(disk, blkno, 1, (void*) buf) < 0) {
+        exit(1);
+    }
+}
+
+/**
+ * Mark a format feature in the superblock, writing the superblock in
+ * place so the mark is on disk before the first structure that uses
+ * the feature, whose blocks are written later.
+ *
+ * @param feature the FS_FEATURE_* bit
+ */
+static void super_set_feature(uint32_t feature)
+{
+    if (super.features & feature) return;
+    super.features |= feature;
+    if (disk->ops->write(disk, 0, 1, &super) < 0) exit(1);
+}
+
+static void delalloc_flush_all(void);
+
+/**
+ * Flush dirty metadata blocks to disk. With a journal, the dirty
+ * blocks are logged and committed along with the directory and
+ * pointer blocks logged since the last flush, which makes them
+ * durable; home locations are written at the journal checkpoint.
+ * Blocks buffered for delayed allocation are allocated and written
+ * first, and newly allocated blocks written since the last flush are
+ * flushed to the disk, even from a write-back cache, before any of
+ * the metadata. Metadata on disk thus never maps a new block whose
+ * data is not there, which would expose its old contents after a
+ * crash.
  */
 void flush_metadata(void)
 {
+    delalloc_flush_all();
+    if (uninit_written) {
+        if (disk->ops->flush(disk, 0, disk->ops->num_blocks(disk)) < 0) exit(1);
+        uninit_written = false;
+    }
+
+    struct io_batch b = {0};
     int i;
     for (i = 0; i < dirty_len; i++) {
         if (dirty[i]) {
-            disk->ops->write(disk, i, 1, dirty[i]);
+            if (journal != NULL) {
+                if (journal_log(journal, i, dirty[i]) < 0) exit(1);
+            } else {
+                batch_add(&b, BLKDEV_WRITE, i, dirty[i]);
+            }
             dirty[i] = NULL;
         }
     }
+    n_dirty = 0;
+    batch_flush(&b);
+    if (journal != NULL && journal_commit(journal) < 0) exit(1);
+    last_flush = time(NULL);
 }
 
 /**
- * Count number of free blocks
+ * Make all completed writes durable: write back dirty metadata and
+ * flush the whole disk. Concurrent callers share one flush.
+ *
+ * @return 0 if successful, -EIO if the disk flush failed
+ */
+static int fs_sync(void)
+{
+    pthread_mutex_lock(&sync_lock);
+    unsigned long ticket = ++sync_ticket;
+    while (sync_done < ticket) {
+        if (sync_busy) {
+            pthread_cond_wait(&sync_cond, &sync_lock);
+            continue;
+        }
+        //flush for all requests so far, including ones that waited
+        unsigned long batch = sync_ticket;
+        sync_busy = true;
+        pthread_mutex_unlock(&sync_lock);
+        //a journal commit flushes the disk
+        pthread_mutex_lock(&fs_lock);
+        flush_metadata();
+        int result = delalloc_status;
+        delalloc_status = SUCCESS;
+        pthread_mutex_unlock(&fs_lock);
+        if (journal == NULL && disk->ops->flush(disk, 0, disk->ops->num_blocks(disk)) < 0) {
+            result = -EIO;
+        }
+        pthread_mutex_lock(&sync_lock);
+        sync_busy = false;
+        sync_done = batch;
+        sync_status = result;
+        pthread_cond_broadcast(&sync_cond);
+    }
+    int result = sync_status;
+    pthread_mutex_unlock(&sync_lock);
+    return result;
+}
+
+/**
+ * End an operation that changed metadata. Dirty metadata blocks are
+ * flushed if METADATA_FLUSH_SECS have passed since the last flush,
+ * or if the running journal transaction is nearly full. Flushing
+ * only between operations keeps each operation's changes in the
+ * same journal transaction.
+ */
+static void flush_metadata_timed(void)
+{
+    if (time(NULL) - last_flush >= METADATA_FLUSH_SECS
+        || (journal != NULL && journal_room(journal) < n_dirty + JOURNAL_OP_BLKS)) {
+        flush_metadata();
+    }
+}
+
+/**
+ * Count the blocks reserved for delayed allocation: the buffered
+ * blocks, and pointer or extent blocks that may be needed to map them.
+ *
+ * @return number of reserved blocks
+ */
+static int delalloc_reserved(void)
+{
+    int n = 0;
+    for (int i = 0; i < DELALLOC_INODES; i++) {
+        if (delalloc[i].nblks > 0) n += delalloc[i].nblks + delalloc[i].nblks / PTRS_PER_BLK + 3;
+    }
+    return n;
+}
+
+/**
+ * Discard the blocks buffered for a file that is being freed or
+ * truncated, which then never reach the disk.
+ *
+ * @param inum the inode number
+ */
+static void delalloc_drop(int inum)
+{
+    struct fs_delalloc *d = &delalloc[inum % DELALLOC_INODES];
+    if (d->inum == inum) {
+        d->inum = 0;
+        d->nblks = 0;
+    }
+}
+
+/**
+ * Count number of free blocks, less those reserved for delayed allocation
  * @return number of free blocks
  */
 int num_free_blk() {
-    int count = 0;
-    for (int i = 0; i < n_blocks; i++) {
-        if (!FD_ISSET(i, block_map)) {
-            count++;
+    return n_free_blks - delalloc_reserved();
+}
+
+/**
+ * Find the end of the reservation holding a block, or the start
+ * of the next reservation after it.
+ *
+ * @param blkno the block number
+ * @param next set to the start of the next reservation, or n_blocks
+ * @return the end of the reservation holding blkno, or -1
+ */
+static int resv_find(int blkno, int *next)
+{
+    *next = n_blocks;
+    for (int i = 0; i < RESV_INODES; i++) {
+        struct fs_resv *r = &resv[i];
+        if (r->len == 0) continue;
+        if (blkno >= r->start && blkno < r->start + r->len) return r->start + r->len;
+        if (r->start > blkno && r->start < *next) *next = r->start;
+    }
+    return -1;
+}
+
+/**
+ * Find a run of free blocks that are not reserved, searching from
+ * a goal block to the end of the disk and then from the start: the
+ * first run of at least nblks blocks, or else the longest run of the
+ * first FIND_RUN_MAX_SCAN.
+ *
+ * @param goal the block to search from, or 0 to search from the
+ *   next-fit cursor
+ * @param nblks the number of blocks wanted
+ * @param len set to the run length, at most nblks
+ * @return the first block of the run, or -1 if none is free
+ */
+static int find_free_run(int goal, int nblks, int *len)
+{
+    if (goal <= 0 || goal >= n_blocks) goal = blk_rotor;
+    int best = -1, best_len = 0, scanned = 0;
+    for (int pass = 0; pass < 2 && best_len < nblks && scanned < FIND_RUN_MAX_SCAN; pass++) {
+        int hi = pass == 0 ? n_blocks : goal;
+        int start = bitmap_find_zero(block_map, pass == 0 ? goal : 0, hi);
+        while (start >= 0) {
+            int next, end = resv_find(start, &next);
+            if (end < 0) {
+                end = bitmap_find_set(block_map, start, next);
+                if (end < 0) end = next;
+                if (end - start > best_len) {
+                    best = start;
+                    best_len = end - start;
+                    if (best_len >= nblks) break;
+                }
+                if (++scanned == FIND_RUN_MAX_SCAN) break;
+            }
+            start = end < hi ? bitmap_find_zero(block_map, end, hi) : -1;
         }
     }
-    return count;
+    *len = best_len < nblks ? best_len : nblks;
+    return best;
+}
+
+/**
+ * Drop the reservation of a file, leaving its blocks free.
+ *
+ * @param inum the inode number
+ */
+static void resv_drop(int inum)
+{
+    struct fs_resv *r = &resv[inum % RESV_INODES];
+    if (r->inum == inum) memset(r, 0, sizeof(*r));
+}
+
+/**
+ * Allocate a run of blocks.
+ *
+ * @param start the first block
+ * @param nblks the number of blocks
+ */
+static void alloc_run(int start, int nblks)
+{
+    for (int i = start; i < start + nblks; i++) {
+        bitmap_set(block_map, i);
+        mark_block_map(i);
+        groups[i / group_blks].free_blocks--;
+    }
+    n_free_blks -= nblks;
+    blk_rotor = start + nblks < n_blocks ? start + nblks : 0;
+}
+
+/**
+ * Returns a run of up to nblks contiguous free blocks. Blocks
+ * reserved for files are only used when no others are free.
+ *
+ * @param goal the block to allocate near, or 0 for the next fit
+ * @param nblks the number of blocks wanted
+ * @param got set to the number of blocks allocated
+ * @return the first block or -ENOSPC if none available
+ */
+static int get_free_blks(int goal, int nblks, int *got)
+{
+    int avail = num_free_blk();
+    if (avail <= 0) return -ENOSPC;
+    if (nblks > avail) nblks = avail;
+    int start = find_free_run(goal, nblks, got);
+    if (start < 0) {
+        memset(resv, 0, sizeof(resv));
+        start = find_free_run(goal, nblks, got);
+        if (start < 0) return -ENOSPC;
+    }
+    alloc_run(start, *got);
+    return start;
 }
 
 /**
  * Returns a free block number or -ENOSPC if none available.
+ * The block contents are not initialized; callers either write
+ * the whole block or use get_zeroed_blk().
  *
  * @return free block number or -ENOSPC if none available
  */
 static int get_free_blk(void)
 {
-    for (int i = 0; i < n_blocks; i++) {
-        if (!FD_ISSET(i, block_map)) {
-            char buff[BLOCK_SIZE];
-            memset(buff, 0, BLOCK_SIZE);
-            if (disk->ops->write(disk, i, 1, buff) < 0) exit(1);
-            FD_SET(i, block_map);
-            return i;
-        }
+    int got;
+    return get_free_blks(0, 1, &got);
+}
+
+/**
+ * Returns a run of up to nblks contiguous blocks for a file, from
+ * its reservation if it has one. Otherwise the blocks following a
+ * new run are reserved for the file: at least as many as the run,
+ * and twice as many as last time if the file used up its reservation.
+ *
+ * @param inum the inode number
+ * @param goal the block to allocate near, or 0 for the next fit
+ * @param nblks the number of blocks wanted
+ * @param got set to the number of blocks allocated
+ * @return the first block or -ENOSPC if none available
+ */
+static int get_file_blks(int inum, int goal, int nblks, int *got)
+{
+    int avail = num_free_blk();
+    if (avail <= 0) return -ENOSPC;
+    if (nblks > avail) nblks = avail;
+    struct fs_resv *r = &resv[inum % RESV_INODES];
+    if (r->inum != inum || r->len == 0) {
+        int window = r->inum == inum ? 2 * r->window : RESV_MIN_BLKS;
+        if (window < nblks) window = nblks;
+        if (window > RESV_MAX_BLKS) window = RESV_MAX_BLKS;
+        memset(r, 0, sizeof(*r));
+        int len, start = find_free_run(goal, nblks + window, &len);
+        if (start < 0 || len <= nblks) return get_free_blks(goal, nblks, got);
+        r->inum = inum;
+        r->start = start;
+        r->len = len;
+        r->window = window;
     }
-    return -ENOSPC;
+    *got = r->len < nblks ? r->len : nblks;
+    int start = r->start;
+    r->start += *got;
+    r->len -= *got;
+    alloc_run(start, *got);
+    return start;
+}
+
+/**
+ * Take up to nblks contiguous blocks of a write's run, allocating
+ * a new run of the blocks the write still needs near the last block
+ * taken when it is used up.
+ *
+ * @param run the run
+ * @param nblks the number of blocks wanted
+ * @param got set to the number of blocks taken
+ * @return the first block number, or -ENOSPC if none available
+ */
+static int run_get_blks(struct blk_run *run, int nblks, int *got)
+{
+    if (run->left == 0) {
+        int start = get_file_blks(run->inum, run->goal, run->want > 0 ? run->want : nblks,
+                                  &run->left);
+        if (start < 0) return start;
+        run->next = start;
+    }
+    *got = run->left < nblks ? run->left : nblks;
+    int start = run->next;
+    run->want -= *got;
+    run->left -= *got;
+    run->next += *got;
+    run->goal = run->next;
+    return start;
+}
+
+/**
+ * Take the next block of a write's run, as run_get_blks().
+ *
+ * @param run the run
+ * @return the block number, or -ENOSPC if none available
+ */
+static int run_get_blk(struct blk_run *run)
+{
+    int got;
+    return run_get_blks(run, 1, &got);
+}
+
+/**
+ * Free the unused blocks of a write's run, returning them to the
+ * file's reservation if they are just before it.
+ *
+ * @param run the run
+ */
+static void run_put(struct blk_run *run)
+{
+    if (run->left == 0) return;
+    for (int i = run->next; i < run->next + run->left; i++) {
+        bitmap_clear(block_map, i);
+        mark_block_map(i);
+        groups[i / group_blks].free_blocks++;
+    }
+    n_free_blks += run->left;
+
+    struct fs_resv *r = &resv[run->inum % RESV_INODES];
+    if (r->inum == run->inum && r->start == run->next + run->left) {
+        r->start = run->next;
+        r->len += run->left;
+    }
+    run->left = 0;
+}
+
+/**
+ * Returns a free block number whose contents have been zeroed,
+ * or -ENOSPC if none available.
+ *
+ * @param goal the block to allocate near, or 0 for the next fit
+ * @return free block number or -ENOSPC if none available
+ */
+static int get_zeroed_blk(int goal)
+{
+    int got;
+    int freeb = get_free_blks(goal, 1, &got);
+    if (freeb >= 0) {
+        char buff[BLOCK_SIZE];
+        memset(buff, 0, BLOCK_SIZE);
+        meta_write(freeb, buff);
+    }
+    return freeb;
 }
 
 /**
@@ -319,32 +1208,82 @@ static int get_free_blk(void)
  */
 static void return_blk(int blkno)
 {
-    FD_CLR(blkno, block_map);
+    if (bitmap_test(block_map, blkno)) {
+        n_free_blks++;
+        groups[blkno / group_blks].free_blocks++;
+    }
+    bitmap_clear(block_map, blkno);
+    bitmap_clear(uninit_map, blkno);
+    mark_block_map(blkno);
+
+    //a logged copy must not overwrite the block's next use
+    if (journal != NULL && journal_revoke(journal, blkno) < 0) exit(1);
 }
 
-static void update_blk(void)
+/**
+ * Returns a free inode number: one in the same inode block as a
+ * goal inode if there is one, or else in the goal's block group,
+ * or else the next free inode after the last one allocated.
+ *
+ * @param goal the inode to allocate near, or 0 for the next fit
+ * @return a free inode number or -ENOSPC if none available
+ */
+static int get_free_inode(int goal)
 {
-    if (disk->ops->write(disk,
-                         block_map_base,
-                         inode_base - block_map_base,
-                         block_map) < 0)
-        exit(1);
+    int i = -1;
+    if (goal > 0) {
+        int first = goal - goal % INODES_PER_BLK;
+        int last = first + INODES_PER_BLK < n_inodes ? first + INODES_PER_BLK : n_inodes;
+        i = bitmap_find_zero(inode_map, first < 2 ? 2 : first, last);
+    }
+    if (i < 0 && goal > 0 && n_groups > 1) {
+        int g = goal / group_inodes;
+        i = bitmap_find_zero(inode_map, g == 0 ? 2 : g * group_inodes, (g + 1) * group_inodes);
+    }
+    if (i < 0) i = bitmap_find_zero(inode_map, inode_rotor, n_inodes);
+    if (i < 0) i = bitmap_find_zero(inode_map, 2, inode_rotor);
+    if (i < 0) return -ENOSPC;
+    bitmap_set(inode_map, i);
+    mark_inode_map(i);
+    n_free_inodes--;
+    groups[i / group_inodes].free_inodes--;
+    inode_rotor = i + 1 < n_inodes ? i + 1 : 2;
+    return i;
 }
 
 /**
- * Returns a free inode number
+ * Choose the block group for a new directory: the one with the most
+ * free blocks among those with at least the average number of free
+ * inodes, so directory trees spread over the disk and each
+ * directory's files have room near it. If no group qualifies, the
+ * one with the most free inodes.
  *
- * @return a free inode number or -ENOSPC if none available
+ * @return the group number
  */
-static int get_free_inode(void)
+static int dir_group(void)
 {
-    for (int i = 2; i < n_inodes; i++) {
-        if (!FD_ISSET(i, inode_map)) {
-            FD_SET(i, inode_map);
-            return i;
+    int best = -1, most_inodes = 0;
+    for (int g = 0; g < n_groups; g++) {
+        if ((long) groups[g].free_inodes * n_groups >= n_free_inodes &&
+            (best < 0 || groups[g].free_blocks > groups[best].free_blocks)) {
+            best = g;
+        }
+        if (groups[g].free_inodes > groups[most_inodes].free_inodes) {
+            most_inodes = g;
         }
     }
-    return -ENOSPC;
+    return best >= 0 ? best : most_inodes;
+}
+
+/**
+ * Get the first data block of a block group.
+ *
+ * @param g the group number
+ * @return the block number
+ */
+static int group_data_start(int g)
+{
+    return group_start(g) + inode_base + group_inode_blks;
 }
 
 /**
@@ -354,21 +1293,25 @@ static int get_free_inode(void)
  */
 static void return_inode(int inum)
 {
-    FD_CLR(inum, inode_map);
+    if (bitmap_test(inode_map, inum)) {
+        n_free_inodes++;
+        groups[inum / group_inodes].free_inodes++;
+    }
+    bitmap_clear(inode_map, inum);
+    mark_inode_map(inum);
 }
 
+/**
+ * Mark an inode as changed. The inode block and any bitmap blocks
+ * changed by allocation are written back by flush_metadata, which
+ * is called at the end of the operation if METADATA_FLUSH_SECS have
+ * passed, on fsync, or on unmount.
+ *
+ * @param inum the inode number
+ */
 static void update_inode(int inum)
 {
-    if (disk->ops->write(disk,
-                         inode_base + inum / INODES_PER_BLK,
-                         1,
-                         &inodes[inum - (inum % INODES_PER_BLK)]) < 0)
-        exit(1);
-    if (disk->ops->write(disk,
-                         inode_map_base,
-                         block_map_base - inode_map_base,
-                         inode_map) < 0)
-        exit(1);
+    mark_inode(&inodes[inum]);
 }
 
 /**
@@ -387,22 +1330,468 @@ static int find_free_dir(struct fs_dirent *de)
     return -ENOSPC;
 }
 
+/* directory block access -- fs_bmap maps file blocks, and is
+ * defined with the file data routines below
+ */
+static int fs_bmap(int inode_idx, int lblk, int nblks, uint32_t *pblks, bool alloc);
+
 /**
- * Determines whether directory is empty.
+ * Hash a directory entry name for the directory index.
  *
- * @param de ptr to first entry in directory
- * @return 1 if empty 0 if has entries
+ * @param name the entry name
+ * @return the name hash
+ */
+static uint32_t dir_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (const char *p = name; *p != '\0'; p++) {
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Read a directory block.
+ *
+ * @param dir the directory inode
+ * @param lblk the directory file block
+ * @param buf the block buffer
+ */
+static void dir_read(int dir, int lblk, void *buf)
+{
+    uint32_t pblk;
+    if (fs_bmap(dir, lblk, 1, &pblk, false) != 1) exit(1);
+    meta_read(pblk, buf);
+}
+
+/**
+ * Write a directory block.
+ *
+ * @param dir the directory inode
+ * @param lblk the directory file block
+ * @param buf the block buffer
+ */
+static void dir_write(int dir, int lblk, void *buf)
+{
+    uint32_t pblk;
+    if (fs_bmap(dir, lblk, 1, &pblk, false) != 1) exit(1);
+    meta_write(pblk, buf);
+    bitmap_clear(uninit_map, pblk);
+}
+
+/**
+ * Add a block to the end of an indexed directory.
+ *
+ * @param dir the directory inode
+ * @return the new directory file block, or -ENOSPC
+ */
+static int dir_new_blk(int dir)
+{
+    struct fs_inode *inode = &inodes[dir];
+    int lblk = inode->size / BLOCK_SIZE;
+    uint32_t pblk;
+    if (fs_bmap(dir, lblk, 1, &pblk, true) != 1) return -ENOSPC;
+    inode->size += BLOCK_SIZE;
+    update_inode(dir);
+    return lblk;
+}
+
+/**
+ * Find the index entry covering a hash.
+ *
+ * @param node the index node
+ * @param hash the name hash
+ * @return index of the last entry whose hash is <= hash
+ */
+static int dx_search(struct fs_dx_node *node, uint32_t hash)
+{
+    int lo = 0, hi = node->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (node->entries[mid].hash <= hash) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * Insert an entry into an index node after a position.
+ *
+ * @param node the index node, which must not be full
+ * @param pos the position of the new entry
+ * @param hash the lowest hash covered by the new entry
+ * @param block the directory file block
+ */
+static void dx_insert(struct fs_dx_node *node, int pos, uint32_t hash, uint32_t block)
+{
+    memmove(&node->entries[pos + 1], &node->entries[pos],
+            (node->count - pos) * sizeof(struct fs_dx_entry));
+    node->entries[pos].hash = hash;
+    node->entries[pos].block = block;
+    node->count++;
+}
+
+/** path from the index root to a leaf block */
+struct dx_path {
+    int levels;                     // index levels below root
+    struct fs_dx_node root;         // index root, directory block 0
+    int root_pos;                   // entry used in root
+    struct fs_dx_node node;         // index block if levels == 1
+    int node_lblk;                  // directory block of index block
+    int node_pos;                   // entry used in index block
+    int leaf;                       // directory block of leaf
+};
+
+/**
+ * Find the leaf block of an indexed directory that holds a hash.
+ *
+ * @param dir the directory inode
+ * @param hash the name hash
+ * @param path the path to fill in
+ */
+static void dx_find_leaf(int dir, uint32_t hash, struct dx_path *path)
+{
+    dir_read(dir, 0, &path->root);
+    path->levels = path->root.levels;
+    path->root_pos = dx_search(&path->root, hash);
+    path->leaf = path->root.entries[path->root_pos].block;
+    if (path->levels == 1) {
+        path->node_lblk = path->leaf;
+        dir_read(dir, path->node_lblk, &path->node);
+        path->node_pos = dx_search(&path->node, hash);
+        path->leaf = path->node.entries[path->node_pos].block;
+    }
+}
+
+/**
+ * Convert a full single-block directory to an indexed directory
+ * with one leaf block.
+ *
+ * @param dir the directory inode
+ * @return SUCCESS, or -ENOSPC
+ */
+static int dx_convert(int dir)
+{
+    struct fs_inode *inode = &inodes[dir];
+    if (num_free_blk() < 3) return -ENOSPC;
+
+    //mark the format feature before any indexed directory exists
+    super_set_feature(FS_FEATURE_HTREE);
+
+    //move the entries to a leaf block
+    struct fs_dirent entries[DIRENTS_PER_BLK];
+    dir_read(dir, 0, entries);
+    int size = inode->size;
+    inode->size = BLOCK_SIZE;
+    int leaf = dir_new_blk(dir);
+    if (leaf < 0) {
+        inode->size = size;
+        return leaf;
+    }
+    dir_write(dir, leaf, entries);
+
+    //block 0 becomes the index root
+    struct fs_dx_node root;
+    memset(&root, 0, sizeof(root));
+    root.count = 1;
+    root.entries[0].hash = 0;
+    root.entries[0].block = leaf;
+    dir_write(dir, 0, &root);
+    inode->flags |= FS_INODE_HTREE;
+    update_inode(dir);
+    return SUCCESS;
+}
+
+/**
+ * Add an index entry for a new block at the position following
+ * a path, splitting the index block or adding an index level if
+ * the node is full.
+ *
+ * @param dir the directory inode
+ * @param path the path to the block that was split
+ * @param hash the lowest hash covered by the new block
+ * @param block the new directory file block
+ * @return SUCCESS, or -ENOSPC
+ */
+static int dx_add_entry(int dir, struct dx_path *path, uint32_t hash, int block)
+{
+    if (path->levels == 0) {
+        if (path->root.count < DX_ENTRIES_PER_BLK) {
+            dx_insert(&path->root, path->root_pos + 1, hash, block);
+            dir_write(dir, 0, &path->root);
+            return SUCCESS;
+        }
+
+        //root is full: move its entries to an index block below the root
+        int node_lblk = dir_new_blk(dir);
+        if (node_lblk < 0) return node_lblk;
+        path->node = path->root;
+        path->node.levels = 0;
+        path->node_lblk = node_lblk;
+        path->node_pos = path->root_pos;
+        path->root.count = 1;
+        path->root.levels = path->levels = 1;
+        path->root.entries[0].hash = 0;
+        path->root.entries[0].block = node_lblk;
+        path->root_pos = 0;
+        dir_write(dir, node_lblk, &path->node);
+        dir_write(dir, 0, &path->root);
+    }
+
+    if (path->node.count < DX_ENTRIES_PER_BLK) {
+        dx_insert(&path->node, path->node_pos + 1, hash, block);
+        dir_write(dir, path->node_lblk, &path->node);
+        return SUCCESS;
+    }
+
+    //index block is full: split it in half and add the upper half to the root
+    if (path->root.count >= DX_ENTRIES_PER_BLK) return -ENOSPC;
+    int new_lblk = dir_new_blk(dir);
+    if (new_lblk < 0) return new_lblk;
+    struct fs_dx_node upper;
+    memset(&upper, 0, sizeof(upper));
+    int half = path->node.count / 2;
+    upper.count = path->node.count - half;
+    memcpy(upper.entries, &path->node.entries[half], upper.count * sizeof(struct fs_dx_entry));
+    path->node.count = half;
+    if (path->node_pos + 1 >= half) {
+        dx_insert(&upper, path->node_pos + 1 - half, hash, block);
+    } else {
+        dx_insert(&path->node, path->node_pos + 1, hash, block);
+    }
+    dx_insert(&path->root, path->root_pos + 1, upper.entries[0].hash, new_lblk);
+    dir_write(dir, path->node_lblk, &path->node);
+    dir_write(dir, new_lblk, &upper);
+    dir_write(dir, 0, &path->root);
+    return SUCCESS;
+}
+
+/**
+ * Compare directory entries by name hash for sorting.
+ */
+static int dirent_hash_cmp(const void *a, const void *b)
+{
+    uint32_t ha = dir_hash(((const struct fs_dirent*) a)->name);
+    uint32_t hb = dir_hash(((const struct fs_dirent*) b)->name);
+    return ha < hb ? -1 : ha > hb;
+}
+
+/**
+ * Split a full leaf block of an indexed directory, moving the
+ * entries with the upper half of the hashes to a new leaf.
+ *
+ * @param dir the directory inode
+ * @param path the path to the leaf
+ * @param entries the leaf entries, updated to the half holding hash
+ * @param hash the hash of the name to be added
+ * @return the directory block now holding hash, or -ENOSPC
  */
-static int is_empty_dir(struct fs_dirent *de)
+static int dx_split_leaf(int dir, struct dx_path *path, struct fs_dirent *entries, uint32_t hash)
 {
+    //index updates need at most two blocks besides the new leaf,
+    //plus pointer blocks to map them
+    if (num_free_blk() < 5) return -ENOSPC;
+    if (path->levels == 1 && path->node.count >= DX_ENTRIES_PER_BLK
+        && path->root.count >= DX_ENTRIES_PER_BLK) return -ENOSPC;
+
+    //split between different hashes, as near the middle as possible
+    qsort(entries, DIRENTS_PER_BLK, sizeof(struct fs_dirent), dirent_hash_cmp);
+    int split = -1;
+    for (int d = 0; d < DIRENTS_PER_BLK / 2 && split < 0; d++) {
+        int k = DIRENTS_PER_BLK / 2 + d;
+        if (k < DIRENTS_PER_BLK && dir_hash(entries[k].name) != dir_hash(entries[k - 1].name)) {
+            split = k;
+        } else if (d > 0 && dir_hash(entries[k - 2 * d].name) != dir_hash(entries[k - 2 * d - 1].name)) {
+            split = k - 2 * d;
+        }
+    }
+    if (split < 0) return -ENOSPC;
+    uint32_t split_hash = dir_hash(entries[split].name);
+
+    int new_leaf = dir_new_blk(dir);
+    if (new_leaf < 0) return new_leaf;
+    struct fs_dirent upper[DIRENTS_PER_BLK];
+    memset(upper, 0, sizeof(upper));
+    memcpy(upper, &entries[split], (DIRENTS_PER_BLK - split) * sizeof(struct fs_dirent));
+    memset(&entries[split], 0, (DIRENTS_PER_BLK - split) * sizeof(struct fs_dirent));
+
+    int res = dx_add_entry(dir, path, split_hash, new_leaf);
+    if (res < 0) return res;
+    dir_write(dir, path->leaf, entries);
+    dir_write(dir, new_leaf, upper);
+    if (hash >= split_hash) {
+        memcpy(entries, upper, sizeof(upper));
+        return new_leaf;
+    }
+    return path->leaf;
+}
+
+/**
+ * Find a directory entry by name.
+ *
+ * @param dir the directory inode
+ * @param name the entry name
+ * @param de pointer to space for the entry, or NULL
+ * @return true if the entry was found
+ */
+static bool dir_find(int dir, const char *name, struct fs_dirent *de)
+{
+    struct fs_dirent entries[DIRENTS_PER_BLK];
+    if (inodes[dir].flags & FS_INODE_HTREE) {
+        struct dx_path path;
+        dx_find_leaf(dir, dir_hash(name), &path);
+        dir_read(dir, path.leaf, entries);
+    } else {
+        dir_read(dir, 0, entries);
+    }
     for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        if (de[i].valid) {
-            return 0;
+        if (entries[i].valid && strcmp(entries[i].name, name) == 0) {
+            if (de != NULL) *de = entries[i];
+            return true;
         }
     }
+    return false;
+}
+
+/**
+ * Add an entry to a directory, converting a full single-block
+ * directory to an indexed directory.
+ *
+ * @param dir the directory inode
+ * @param name the entry name
+ * @param inum the entry inode
+ * @param isDir true if the entry is a directory
+ * @return SUCCESS, or -ENOSPC
+ */
+static int dir_add(int dir, const char *name, int inum, bool isDir)
+{
+    struct fs_dirent entries[DIRENTS_PER_BLK];
+    int lblk = 0;
+    int slot = -ENOSPC;
+    if (!(inodes[dir].flags & FS_INODE_HTREE)) {
+        dir_read(dir, 0, entries);
+        slot = find_free_dir(entries);
+        if (slot < 0) {
+            int res = dx_convert(dir);
+            if (res < 0) return res;
+        }
+    }
+    if (inodes[dir].flags & FS_INODE_HTREE) {
+        uint32_t hash = dir_hash(name);
+        struct dx_path path;
+        dx_find_leaf(dir, hash, &path);
+        lblk = path.leaf;
+        dir_read(dir, lblk, entries);
+        slot = find_free_dir(entries);
+        if (slot < 0) {
+            lblk = dx_split_leaf(dir, &path, entries, hash);
+            if (lblk < 0) return lblk;
+            slot = find_free_dir(entries);
+        }
+    }
+
+    struct fs_dirent *de = &entries[slot];
+    memset(de, 0, sizeof(*de));
+    strcpy(de->name, name);
+    de->inode = inum;
+    de->isDir = isDir;
+    de->valid = true;
+    dir_write(dir, lblk, entries);
+    return SUCCESS;
+}
+
+/**
+ * Remove an entry from a directory.
+ *
+ * @param dir the directory inode
+ * @param name the entry name
+ * @return SUCCESS, or -ENOENT if not found
+ */
+static int dir_remove(int dir, const char *name)
+{
+    struct fs_dirent entries[DIRENTS_PER_BLK];
+    int lblk = 0;
+    if (inodes[dir].flags & FS_INODE_HTREE) {
+        struct dx_path path;
+        dx_find_leaf(dir, dir_hash(name), &path);
+        lblk = path.leaf;
+    }
+    dir_read(dir, lblk, entries);
+    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+        if (entries[i].valid && strcmp(entries[i].name, name) == 0) {
+            memset(&entries[i], 0, sizeof(struct fs_dirent));
+            dir_write(dir, lblk, entries);
+            return SUCCESS;
+        }
+    }
+    return -ENOENT;
+}
+
+/**
+ * Call a function for each entry of a directory until it
+ * returns nonzero.
+ *
+ * @param dir the directory inode
+ * @param fn the function to call with each valid entry
+ * @param arg argument passed to fn
+ * @return the first nonzero result of fn, or 0
+ */
+static int dir_for_each(int dir, int (*fn)(struct fs_dirent *de, void *arg), void *arg)
+{
+    struct fs_dirent entries[DIRENTS_PER_BLK];
+    int leaves[DX_ENTRIES_PER_BLK];
+    int nleaves = 1;
+    struct fs_dx_node root, node;
+    int nnodes = 1;
+    if (inodes[dir].flags & FS_INODE_HTREE) {
+        dir_read(dir, 0, &root);
+        nnodes = root.levels == 1 ? root.count : 1;
+    }
+
+    for (int n = 0; n < nnodes; n++) {
+        if (!(inodes[dir].flags & FS_INODE_HTREE)) {
+            leaves[0] = 0;
+        } else {
+            if (root.levels == 1) {
+                dir_read(dir, root.entries[n].block, &node);
+            } else {
+                node = root;
+            }
+            nleaves = node.count;
+            for (int i = 0; i < nleaves; i++) leaves[i] = node.entries[i].block;
+        }
+        for (int l = 0; l < nleaves; l++) {
+            dir_read(dir, leaves[l], entries);
+            for (int i = 0; i < DIRENTS_PER_BLK; i++) {
+                if (entries[i].valid) {
+                    int res = fn(&entries[i], arg);
+                    if (res != 0) return res;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Directory iteration function that stops at the first entry.
+ */
+static int dir_has_entry(struct fs_dirent *de, void *arg)
+{
     return 1;
 }
 
+/**
+ * Determines whether directory is empty.
+ *
+ * @param dir the directory inode
+ * @return 1 if empty 0 if has entries
+ */
+static int is_empty_dir(int dir)
+{
+    return dir_for_each(dir, dir_has_entry, NULL) == 0;
+}
+
 /**
  * Copy stat from inode to sb
  * @param inode inode to be copied from
@@ -423,8 +1812,39 @@ static void cpy_stat(struct fs_inode *inode, struct stat *sb) {
     sb->st_blocks = (inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
 }
 
-/* Fuse functions
- */
+/* Fuse functions
+ */
+
+/**
+ * Add a journal to a file system that has none, in the first run
+ * of free blocks long enough to hold it. The file system must be
+ * initialized. Nothing is changed if there is no room.
+ *
+ * @param nblks the journal size in blocks
+ */
+static void journal_create(int nblks)
+{
+    if (nblks < JOURNAL_MIN_BLKS) {
+        fprintf(stderr, "journal must be at least %d blocks\n", JOURNAL_MIN_BLKS);
+        return;
+    }
+    int len, start = find_free_run(0, nblks, &len);
+    if (len < nblks) {
+        fprintf(stderr, "no room for a %d block journal\n", nblks);
+        return;
+    }
+
+    alloc_run(start, nblks);
+    flush_metadata();
+    if (journal_format(disk, start, nblks) < 0) exit(1);
+
+    super.features |= FS_FEATURE_JOURNAL;
+    super.journal_start = start;
+    super.journal_blks = nblks;
+    if (disk->ops->write(disk, 0, 1, &super) < 0) exit(1);
+    if (disk->ops->flush(disk, 0, disk->ops->num_blocks(disk)) < 0) exit(1);
+    if ((journal = journal_open(disk, start, nblks)) == NULL) exit(1);
+}
 
 /**
  * init - this is called once by the FUSE framework at startup.
@@ -438,50 +1858,197 @@ static void cpy_stat(struct fs_inode *inode, struct stat *sb) {
  */
 void* fs_init(struct fuse_conn_info *conn)
 {
+    // if re-initialized, write back pending metadata and free old copies
+    if (dirty != NULL) {
+        flush_metadata();
+        free(inode_map);
+        free(block_map);
+        free(inodes);
+        free(dirty);
+        free(blk_goal);
+        free(groups);
+        if (journal != NULL) {
+            if (journal_close(journal) < 0) exit(1);
+            journal = NULL;
+        }
+    }
+
 	// read the superblock
     struct fs_super sb;
     if (disk->ops->read(disk, 0, 1, &sb) < 0) {
         exit(1);
     }
+    super = sb;
 
     root_inode = sb.root_inode;
 
     /* The inode map and block map are written directly to the disk after the superblock */
 
-    // read inode map
-    inode_map_base = 1;
-    inode_map = malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, inode_map_base, sb.inode_map_sz, inode_map) < 0) {
+    if (sb.features & ~FS_FEATURES_SUPPORTED) {
+        fprintf(stderr, "unsupported file system features 0x%x\n",
+                sb.features & ~FS_FEATURES_SUPPORTED);
         exit(1);
     }
 
-    // read block map
-    block_map_base = inode_map_base + sb.inode_map_sz;
-    block_map = malloc(sb.block_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, block_map_base, sb.block_map_sz, block_map) < 0) {
-        exit(1);
+    // replay the journal before reading any metadata
+    if (sb.features & FS_FEATURE_JOURNAL) {
+        journal = journal_open(disk, sb.journal_start, sb.journal_blks);
+        int replayed = journal != NULL ? journal_replay(journal) : -1;
+        if (replayed < 0) {
+            fprintf(stderr, "cannot replay journal at block %u\n", sb.journal_start);
+            exit(1);
+        }
+        if (replayed > 0) {
+            // counts saved at the last unmount are out of date
+            fprintf(stderr, "replayed %d journal transactions\n", replayed);
+            sb.flags &= ~FS_SUPER_COUNTS;
+        }
     }
 
-    /* The inode data is written to the next set of blocks */
-    inode_base = block_map_base + sb.block_map_sz;
+    // number of blocks on device
+    n_blocks = sb.num_blocks;
     n_inodes = sb.inode_region_sz * INODES_PER_BLK;
-    inodes = malloc(sb.inode_region_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, inode_base, sb.inode_region_sz, inodes) < 0) {
+
+    // find the slices of the maps and inodes in each group
+    if (sb.features & FS_FEATURE_GROUPS) {
+        group_blks = sb.group_blks;
+        group_inodes = sb.group_inodes;
+        n_groups = (n_blocks + group_blks - 1) / group_blks;
+        group_table_sz = (n_groups + GROUPS_PER_BLK - 1) / GROUPS_PER_BLK;
+        group0_start = 1 + group_table_sz;
+        group_bmap_blks = group_blks / BITS_PER_BLK;
+        group_imap_blks = group_inodes / BITS_PER_BLK;
+        group_inode_blks = group_inodes / INODES_PER_BLK;
+        block_map_base = 0;
+        inode_map_base = group_bmap_blks;
+        inode_base = inode_map_base + group_imap_blks;
+    } else {
+        group_blks = n_blocks;
+        group_inodes = n_inodes;
+        n_groups = 1;
+        group_table_sz = 0;
+        group0_start = 0;
+        group_imap_blks = sb.inode_map_sz;
+        group_bmap_blks = sb.block_map_sz;
+        group_inode_blks = sb.inode_region_sz;
+        inode_map_base = 1;
+        block_map_base = inode_map_base + sb.inode_map_sz;
+        inode_base = block_map_base + sb.block_map_sz;
+    }
+    n_meta_blks = group0_start + n_groups * (inode_base + group_inode_blks);
+
+    // read inode map and block map
+    inode_map = meta_region_read(inode_map_base, group_imap_blks, sb.inode_map_sz);
+    block_map = meta_region_read(block_map_base, group_bmap_blks, sb.block_map_sz);
+
+    // directory entry cache stays valid across re-init
+    if (dcache == NULL && (dcache = dcache_create(DCACHE_DEFAULT_ENTRIES)) == NULL) {
         exit(1);
     }
 
-    // number of blocks on device
-    n_blocks = sb.num_blocks;
+    // readahead reads into the block cache, so is only useful with one
+    long hits, misses;
+    ra_enabled = bcache_stats(disk, &hits, &misses) == SUCCESS;
+
+    // uninitialized blocks are new blocks not yet written, and blocks of
+    // unwritten extents as they are mapped; keep them across re-init
+    if (uninit_map == NULL) {
+        uninit_map = calloc(sb.block_map_sz * FS_BLOCK_SIZE, 1);
+    }
 
-    // dirty metadata blocks
-    dirty_len = inode_base + sb.inode_region_sz;
+    /* The inode data is written to the next set of blocks */
+    inodes = meta_region_read(inode_base, group_inode_blks, sb.inode_region_sz);
+
+    // dirty metadata blocks; the last group's inodes are the last ones
+    dirty_len = meta_blk(inode_base, group_inode_blks, sb.inode_region_sz - 1) + 1;
     dirty = calloc(dirty_len*sizeof(void*), 1);
+    memset(resv, 0, sizeof(resv));
+    blk_goal = calloc(n_inodes, sizeof(uint32_t));
+    blk_rotor = sb.blk_rotor < (uint32_t) n_blocks ? sb.blk_rotor : 0;
+    inode_rotor = sb.inode_rotor >= 2 && sb.inode_rotor < (uint32_t) n_inodes ? sb.inode_rotor : 2;
+    last_flush = time(NULL);
+
+    // count free blocks and inodes, checking counts saved at unmount
+    n_free_blks = bitmap_count_zero(block_map, n_blocks);
+    n_free_inodes = bitmap_count_zero(inode_map, n_inodes);
+    for (int i = 0; i < 2 && i < n_inodes; i++) {
+        if (!bitmap_test(inode_map, i)) n_free_inodes--;   // reserved inodes
+    }
+    if ((sb.flags & FS_SUPER_COUNTS) &&
+        (sb.free_blocks != n_free_blks || sb.free_inodes != n_free_inodes)) {
+        fprintf(stderr, "superblock free counts %u/%u do not match maps %d/%d\n",
+                sb.free_blocks, sb.free_inodes, n_free_blks, n_free_inodes);
+    }
+
+    // the same for each group, and the group summaries saved at unmount
+    groups = calloc(group_table_sz > 0 ? group_table_sz * FS_BLOCK_SIZE : sizeof(*groups), 1);
+    if (group_table_sz > 0 && disk->ops->read(disk, 1, group_table_sz, groups) < 0) exit(1);
+    for (int g = 0; g < n_groups; g++) {
+        int blks = g < n_groups - 1 ? group_blks : n_blocks - g * group_blks;
+        int free_blks = bitmap_count_zero(block_map + g * group_blks / BITMAP_WORD_BITS, blks);
+        int free_inodes = bitmap_count_zero(inode_map + g * group_inodes / BITMAP_WORD_BITS,
+                                            group_inodes);
+        for (int i = 0; g == 0 && i < 2; i++) {
+            if (!bitmap_test(inode_map, i)) free_inodes--;      // reserved inodes
+        }
+        if ((sb.flags & FS_SUPER_COUNTS) && group_table_sz > 0 &&
+            (groups[g].free_blocks != free_blks || groups[g].free_inodes != free_inodes)) {
+            fprintf(stderr, "group %d free counts %u/%u do not match maps %d/%d\n", g,
+                    groups[g].free_blocks, groups[g].free_inodes, free_blks, free_inodes);
+        }
+        groups[g].free_blocks = free_blks;
+        groups[g].free_inodes = free_inodes;
+    }
+
+    // counts are only valid until the next change; clear them until unmount
+    if (super.flags & FS_SUPER_COUNTS) {
+        super.flags &= ~FS_SUPER_COUNTS;
+        if (disk->ops->write(disk, 0, 1, &super) < 0) exit(1);
+    }
+
+    // add a journal if requested and the file system has none
+    if (journal == NULL && journal_size > 0) {
+        journal_create(journal_size);
+    }
+
+    // map new inodes by extents if requested; older code can then no
+    // longer mount the file system
+    if (extents_mode) {
+        super_set_feature(FS_FEATURE_EXTENTS);
+    }
 
     /* your code here */
 
     return NULL;
 }
 
+/**
+ * Clean up filesystem on unmount. Dirty metadata is written back,
+ * the free counts are saved in the superblock, and the disk is
+ * flushed. Blocks still uninitialized are in unwritten extents,
+ * which keep reading as zeros at the next mount.
+ *
+ * @param private_data the value returned by fs_init
+ */
+void fs_destroy(void *private_data)
+{
+    flush_metadata();
+    if (journal != NULL) {
+        if (journal_close(journal) < 0) exit(1);
+        journal = NULL;
+    }
+
+    // save free counts for checking at next mount, and where to allocate next
+    super.flags |= FS_SUPER_COUNTS;
+    super.free_blocks = n_free_blks;
+    super.free_inodes = n_free_inodes;
+    super.blk_rotor = blk_rotor;
+    super.inode_rotor = inode_rotor;
+    if (group_table_sz > 0 && disk->ops->write(disk, 1, group_table_sz, groups) < 0) exit(1);
+    if (disk->ops->write(disk, 0, 1, &super) < 0) exit(1);
+    if (disk->ops->flush(disk, 0, disk->ops->num_blocks(disk)) < 0) exit(1);
+}
+
 /* Note on path translation errors:
  * In addition to the method-specific errors listed below, almost
  * every method can return one of the following errors if it fails to
@@ -522,10 +2089,7 @@ void* fs_init(struct fuse_conn_info *conn)
  */
 static int fs_getattr(const char *path, struct stat *sb)
 {
-    fs_init(NULL);
-
-    char *_path = strdup(path);
-    int inode_idx = translate(_path);
+    int inode_idx = translate_path(path);
     if (inode_idx < 0) return inode_idx;
     struct fs_inode* inode = &inodes[inode_idx];
     cpy_stat(inode, sb);
@@ -550,6 +2114,25 @@ static int fs_getattr(const char *path, struct stat *sb)
  * @param offset the file offset -- unused
  * @param fi the fuse file information
  */
+/** arguments for readdir_fill */
+struct readdir_args {
+    void *ptr;                      // filler buf pointer
+    fuse_fill_dir_t filler;         // filler function
+};
+
+/**
+ * Directory iteration function that passes an entry to the
+ * readdir filler function.
+ */
+static int readdir_fill(struct fs_dirent *de, void *arg)
+{
+    struct readdir_args *args = arg;
+    struct stat sb;
+    cpy_stat(&inodes[de->inode], &sb);
+    args->filler(args->ptr, de->name, &sb, 0);
+    return 0;
+}
+
 static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
@@ -558,16 +2141,8 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
     if (inode_idx < 0) return inode_idx;
     struct fs_inode *inode = &inodes[inode_idx];
     if (!S_ISDIR(inode->mode)) return -ENOTDIR;
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    struct stat sb;
-    if (disk->ops->read(disk, inode->direct[0], 1, entries) < 0) exit(1);
-    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        if (entries[i].valid) {
-            cpy_stat(&inodes[entries[i].inode], &sb);
-            filler(ptr, entries[i].name, &sb, 0);
-        }
-    }
+    struct readdir_args args = {ptr, filler};
+    dir_for_each(inode_idx, readdir_fill, &args);
     return SUCCESS;
 }
 
@@ -611,29 +2186,64 @@ static int fs_releasedir(const char *path, struct fuse_file_info *fi)
     return SUCCESS;
 }
 
-static int set_attributes_and_update(struct fs_dirent *de, char *name, mode_t mode, bool isDir)
+/**
+ * Allocate an inode, and a block if a directory, and add an
+ * entry for it to a directory.
+ *
+ * @param parent the directory inode
+ * @param name the entry name
+ * @param mode the mode of the new inode
+ * @param isDir true if the entry is a directory
+ * @return the new inode number, or -ENOSPC
+ */
+static int set_attributes_and_update(int parent, char *name, mode_t mode, bool isDir)
 {
-    //get free directory and inode
-    int freed = find_free_dir(de);
-    int freei = get_free_inode();
-    int freeb = isDir ? get_free_blk() : 0;
-    if (freed < 0 || freei < 0 || freeb < 0) return -ENOSPC;
-    struct fs_dirent *dir = &de[freed];
+    //get free inode and block near the parent directory, or with
+    //block groups, a directory in a roomy group and its files and
+    //their blocks in the directory's group
+    uint32_t goal = 0;
+    int freei;
+    if (n_groups > 1) {
+        int g = isDir ? dir_group() : parent / group_inodes;
+        freei = get_free_inode(isDir ? g * group_inodes + (g == 0 ? 2 : 0) : parent);
+        if (freei >= 0) goal = group_data_start(freei / group_inodes);
+    } else {
+        fs_bmap(parent, 0, 1, &goal, false);
+        freei = get_free_inode(parent);
+    }
+    if (freei < 0) return -ENOSPC;
+    int freeb = isDir ? get_zeroed_blk(goal) : 0;
+    if (freeb < 0) {
+        return_inode(freei);
+        return -ENOSPC;
+    }
+    int res = dir_add(parent, name, freei, isDir);
+    if (res < 0) {
+        if (isDir) return_blk(freeb);
+        return_inode(freei);
+        return res;
+    }
+    //new inodes are mapped by extents if the file system has them
+    bool extents = (super.features & FS_FEATURE_EXTENTS) != 0;
     struct fs_inode *inode = &inodes[freei];
-    strcpy(dir->name, name);
-    dir->inode = freei;
-    dir->isDir = true;
-    dir->valid = true;
+    memset(inode, 0, sizeof(*inode));
     inode->uid = getuid();
     inode->gid = getgid();
     inode->mode = mode;
     inode->ctime = inode->mtime = time(NULL);
     inode->size = 0;
-    inode->direct[0] = freeb;
+    inode->flags = extents ? FS_INODE_EXTENTS : 0;
+    blk_goal[freei] = goal;
+    if (isDir && extents) {
+        inode->ext_hdr.count = 1;
+        inode->extents[0].start = freeb;
+        inode->extents[0].len = 1;
+    } else if (isDir) {
+        inode->direct[0] = freeb;
+    }
     //update map and inode
     update_inode(freei);
-    update_blk();
-    return SUCCESS;
+    return freei;
 }
 
 /**
@@ -648,7 +2258,7 @@ static int set_attributes_and_update(struct fs_dirent *de, char *name, mode_t mo
  *   -ENOTDIR  - component of path not a directory
  *   -EEXIST   - file already exists
  *   -ENOSPC   - free inode not available
- *   -ENOSPC   - results in >32 entries in directory
+ *   -ENOSPC   - no space for directory entry
  *
  * @param path the file path
  * @param mode the mode, indicating block or character-special file
@@ -669,17 +2279,11 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
     struct fs_inode *parent_inode = &inodes[parent_inode_idx];
     if (!(S_ISDIR(parent_inode->mode))) return -ENOTDIR;
 
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
-    //assign inode and directory and update
-    int res = set_attributes_and_update(entries, name, mode, false);
+    //assign inode and directory entry
+    int res = set_attributes_and_update(parent_inode_idx, name, mode, false);
+    flush_metadata_timed();
     if (res < 0) return res;
-
-    //write entries buffer into disk
-    if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
+    dcache_enter(dcache, parent_inode_idx, name, res);
     return SUCCESS;
 }
 
@@ -691,7 +2295,7 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
  *   -ENOTDIR  - component of path not a directory
  *   -EEXIST   - directory already exists
  *   -ENOSPC   - free inode not available
- *   -ENOSPC   - results in >32 entries in directory
+ *   -ENOSPC   - no space for directory entry
  *
  * @param path path to file
  * @param mode the mode for the new directory
@@ -712,20 +2316,521 @@ static int fs_mkdir(const char *path, mode_t mode)
     struct fs_inode *parent_inode = &inodes[parent_inode_idx];
     if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
 
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
-    //assign inode and directory and update
-    int res = set_attributes_and_update(entries, name, mode, true);
+    //assign inode and directory entry
+    int res = set_attributes_and_update(parent_inode_idx, name, mode, true);
+    flush_metadata_timed();
     if (res < 0) return res;
+    dcache_enter(dcache, parent_inode_idx, name, res);
+    return SUCCESS;
+}
 
-    //write entries buffer into disk
-    if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
+/** largest file block of an extent-mapped file, so its size fits in fs_inode */
+enum {EXT_MAX_BLKS = INT32_MAX / FS_BLOCK_SIZE};
+
+/**
+ * Read an extent tree node.
+ *
+ * @param inode the inode
+ * @param blkno the node block number, or 0 for the root in the inode
+ * @param node the buffer for the node
+ */
+static void ext_node_read(struct fs_inode *inode, int blkno, struct fs_extent_node *node)
+{
+    if (blkno == 0) {
+        node->hdr = inode->ext_hdr;
+        memcpy(node->extents, inode->extents, sizeof(inode->extents));
+    } else {
+        meta_read(blkno, node);
+    }
+}
+
+/**
+ * Write an extent tree node. The caller must write the inode back
+ * after changing the root.
+ *
+ * @param inode the inode
+ * @param blkno the node block number, or 0 for the root in the inode
+ * @param node the node
+ */
+static void ext_node_write(struct fs_inode *inode, int blkno, struct fs_extent_node *node)
+{
+    if (blkno == 0) {
+        inode->ext_hdr = node->hdr;
+        memcpy(inode->extents, node->extents, sizeof(inode->extents));
+    } else {
+        meta_write(blkno, node);
+    }
+}
+
+/**
+ * Find the extent tree entry covering a file block.
+ *
+ * @param node the node
+ * @param lblk the file block
+ * @return index of the last entry whose lblk is <= lblk, or -1
+ */
+static int ext_search(struct fs_extent_node *node, uint32_t lblk)
+{
+    int lo = 0, hi = node->hdr.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (node->extents[mid].lblk <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+/**
+ * Read the extent tree leaf that holds a file block.
+ *
+ * @param inode the inode
+ * @param lblk the file block
+ * @param node the buffer for the leaf
+ * @param next set to the first file block of the following leaf,
+ *   or EXT_MAX_BLKS if there is none
+ * @return the leaf block number, or 0 for the root
+ */
+static int ext_leaf(struct fs_inode *inode, uint32_t lblk, struct fs_extent_node *node,
+                    uint32_t *next)
+{
+    int blkno = 0;
+    *next = EXT_MAX_BLKS;
+    ext_node_read(inode, 0, node);
+    while (node->hdr.depth > 0) {
+        int k = ext_search(node, lblk);
+        if (k < 0) k = 0;
+        if (k + 1 < node->hdr.count) *next = node->extents[k + 1].lblk;
+        blkno = node->extents[k].start;
+        ext_node_read(inode, blkno, node);
+    }
+    return blkno;
+}
+
+/**
+ * Find the first extent that maps a file block at or after a given one.
+ *
+ * @param inode the inode
+ * @param lblk the file block
+ * @param ext set to the extent if found
+ * @return true if found
+ */
+static bool ext_next(struct fs_inode *inode, uint32_t lblk, struct fs_extent *ext)
+{
+    struct fs_extent_node node;
+    uint32_t next;
+    while (lblk < EXT_MAX_BLKS) {
+        ext_leaf(inode, lblk, &node, &next);
+        int k = ext_search(&node, lblk);
+        if (k < 0 || lblk >= node.extents[k].lblk + node.extents[k].len) k++;
+        if (k < node.hdr.count) {
+            *ext = node.extents[k];
+            return true;
+        }
+        lblk = next;
+    }
+    return false;
+}
+
+/**
+ * Map a range of file blocks through an extent tree. Blocks of
+ * unwritten extents are marked uninitialized, so they read as zeros.
+ *
+ * @param inode the inode
+ * @param lblk the first file block number
+ * @param nblks the number of blocks to map
+ * @param pblks array to receive disk block numbers
+ * @return the number of blocks mapped, which stops short at the
+ *   first missing block
+ */
+static int ext_map(struct fs_inode *inode, int lblk, int nblks, uint32_t *pblks)
+{
+    struct fs_extent_node node;
+    uint32_t next;
+    int i = 0;
+    while (i < nblks) {
+        //copy extents from the leaf holding the next block until a hole
+        ext_leaf(inode, lblk + i, &node, &next);
+        int k = ext_search(&node, lblk + i);
+        if (k < 0) return i;
+        for ( ; k < node.hdr.count && i < nblks; k++) {
+            struct fs_extent *e = &node.extents[k];
+            if (lblk + i < e->lblk || lblk + i >= e->lblk + e->len) return i;
+            for (uint32_t off = lblk + i - e->lblk; off < e->len && i < nblks; off++) {
+                if (e->unwritten) bitmap_set(uninit_map, e->start + off);
+                pblks[i++] = e->start + off;
+            }
+        }
+    }
+    return i;
+}
+
+/**
+ * Add an entry to an extent tree node, splitting the node if it
+ * is full. An entry added at the end of a full node goes alone into
+ * the new node, so files written in order fill their nodes.
+ *
+ * @param inode the inode
+ * @param blkno the node block number, or 0 for the root
+ * @param node the node
+ * @param pos the position of the new entry
+ * @param ext the new entry
+ * @param split set to the index entry for the new node if split
+ * @return SUCCESS, or 1 if the node was split
+ */
+static int ext_node_add(struct fs_inode *inode, int blkno, struct fs_extent_node *node,
+                        int pos, struct fs_extent *ext, struct fs_extent *split)
+{
+    int max = blkno == 0 ? N_INODE_EXTENTS : EXTENTS_PER_BLK;
+    int n = node->hdr.count;
+    if (n < max) {
+        memmove(&node->extents[pos + 1], &node->extents[pos],
+                (n - pos) * sizeof(struct fs_extent));
+        node->extents[pos] = *ext;
+        node->hdr.count++;
+        ext_node_write(inode, blkno, node);
+        return SUCCESS;
+    }
+
+    //move the upper entries to a new node
+    struct fs_extent all[EXTENTS_PER_BLK + 1];
+    memcpy(all, node->extents, pos * sizeof(struct fs_extent));
+    all[pos] = *ext;
+    memcpy(&all[pos + 1], &node->extents[pos], (n - pos) * sizeof(struct fs_extent));
+    int keep = pos == n ? n : (n + 1) / 2;
+
+    struct fs_extent_node upper;
+    memset(&upper, 0, sizeof(upper));
+    upper.hdr.depth = node->hdr.depth;
+    upper.hdr.count = n + 1 - keep;
+    memcpy(upper.extents, &all[keep], upper.hdr.count * sizeof(struct fs_extent));
+    int freeb = get_free_blk();
+    if (freeb < 0) exit(1);     // reserved by ext_insert
+    meta_write(freeb, &upper);
+
+    node->hdr.count = keep;
+    memcpy(node->extents, all, keep * sizeof(struct fs_extent));
+    ext_node_write(inode, blkno, node);
+
+    split->lblk = upper.extents[0].lblk;
+    split->start = freeb;
+    split->len = 0;
+    return 1;
+}
+
+/**
+ * Map a run of file blocks in the subtree under an extent tree node,
+ * extending an adjacent extent of the same kind if possible.
+ *
+ * @param inode the inode
+ * @param blkno the node block number, or 0 for the root
+ * @param node the node
+ * @param ext the extent to add
+ * @param split set to the index entry for the new node if split
+ * @return SUCCESS, or 1 if the node was split
+ */
+static int ext_node_insert(struct fs_inode *inode, int blkno, struct fs_extent_node *node,
+                           struct fs_extent *ext, struct fs_extent *split)
+{
+    int k = ext_search(node, ext->lblk);
+    if (node->hdr.depth > 0) {
+        if (k < 0) k = 0;
+        struct fs_extent_node child;
+        struct fs_extent child_split;
+        ext_node_read(inode, node->extents[k].start, &child);
+        if (ext_node_insert(inode, node->extents[k].start, &child, ext, &child_split) == 0) {
+            return SUCCESS;
+        }
+        return ext_node_add(inode, blkno, node, k + 1, &child_split, split);
+    }
+
+    //extend the previous extent, joining it to the next if they meet
+    struct fs_extent *prev = k >= 0 ? &node->extents[k] : NULL;
+    struct fs_extent *next = k + 1 < node->hdr.count ? &node->extents[k + 1] : NULL;
+    if (prev != NULL && prev->unwritten == ext->unwritten &&
+        prev->lblk + prev->len == ext->lblk && prev->start + prev->len == ext->start) {
+        prev->len += ext->len;
+        if (next != NULL && next->unwritten == prev->unwritten &&
+            prev->lblk + prev->len == next->lblk && prev->start + prev->len == next->start) {
+            prev->len += next->len;
+            memmove(next, next + 1, (node->hdr.count - k - 2) * sizeof(struct fs_extent));
+            node->hdr.count--;
+        }
+        ext_node_write(inode, blkno, node);
+        return SUCCESS;
+    }
+
+    //or extend the next extent backwards
+    if (next != NULL && next->unwritten == ext->unwritten &&
+        ext->lblk + ext->len == next->lblk && ext->start + ext->len == next->start) {
+        next->lblk = ext->lblk;
+        next->start = ext->start;
+        next->len += ext->len;
+        ext_node_write(inode, blkno, node);
+        return SUCCESS;
+    }
+    return ext_node_add(inode, blkno, node, k + 1, ext, split);
+}
+
+/**
+ * Map a run of unmapped file blocks in an extent tree, adding a
+ * level to the tree if the root splits. The caller must write the
+ * inode back.
+ *
+ * @param inode the inode
+ * @param ext the extent to add
+ * @return SUCCESS, or -ENOSPC if there may be no room for new nodes
+ */
+static int ext_insert(struct fs_inode *inode, struct fs_extent *ext)
+{
+    //each level may split, and the root may move down a level
+    if (num_free_blk() < inode->ext_hdr.depth + 2) return -ENOSPC;
+
+    struct fs_extent_node root;
+    struct fs_extent split;
+    ext_node_read(inode, 0, &root);
+    if (ext_node_insert(inode, 0, &root, ext, &split) == 0) return SUCCESS;
+
+    //move the lower half of the root to a new node and index both halves
+    int freeb = get_free_blk();
+    if (freeb < 0) exit(1);
+    struct fs_extent_node lower;
+    memset(&lower, 0, sizeof(lower));
+    lower.hdr = root.hdr;
+    memcpy(lower.extents, root.extents, root.hdr.count * sizeof(struct fs_extent));
+    meta_write(freeb, &lower);
+
+    memset(&root, 0, sizeof(root));
+    root.hdr.count = 2;
+    root.hdr.depth = lower.hdr.depth + 1;
+    root.extents[0].lblk = lower.extents[0].lblk;
+    root.extents[0].start = freeb;
+    root.extents[1] = split;
+    ext_node_write(inode, 0, &root);
+    return SUCCESS;
+}
+
+/**
+ * Unmap a range of file blocks in the subtree under an extent tree
+ * node, freeing the blocks if requested. Child nodes left empty are
+ * freed. An extent reaching past both ends of the range keeps its
+ * lower part, and its upper part is left for the caller to insert.
+ *
+ * @param inode the inode
+ * @param blkno the node block number, or 0 for the root
+ * @param node the node
+ * @param lblk the first file block
+ * @param end the file block after the range
+ * @param free_blks true to free the unmapped blocks
+ * @param tail set to the upper part of an extent cut in two
+ */
+static void ext_node_remove(struct fs_inode *inode, int blkno, struct fs_extent_node *node,
+                            uint32_t lblk, uint32_t end, bool free_blks, struct fs_extent *tail)
+{
+    bool changed = false;
+    int k = ext_search(node, lblk);
+    if (k < 0) k = 0;
+    while (k < node->hdr.count && node->extents[k].lblk < end) {
+        struct fs_extent *e = &node->extents[k];
+        if (node->hdr.depth > 0) {
+            struct fs_extent_node child;
+            int child_blk = e->start;
+            ext_node_read(inode, child_blk, &child);
+            ext_node_remove(inode, child_blk, &child, lblk, end, free_blks, tail);
+            if (child.hdr.count > 0) {
+                k++;
+                continue;
+            }
+            return_blk(child_blk);
+        } else {
+            uint32_t e_end = e->lblk + e->len;
+            if (e_end <= lblk) {
+                k++;
+                continue;
+            }
+            uint32_t from = e->lblk > lblk ? e->lblk : lblk;
+            uint32_t to = e_end < end ? e_end : end;
+            if (free_blks) {
+                for (uint32_t b = from; b < to; b++) return_blk(e->start + (b - e->lblk));
+            }
+            changed = true;
+
+            //keep the parts of the extent outside the range
+            if (from > e->lblk || to < e_end) {
+                if (from > e->lblk && to < e_end) {
+                    *tail = *e;
+                    tail->lblk = to;
+                    tail->start = e->start + (to - e->lblk);
+                    tail->len = e_end - to;
+                }
+                if (from > e->lblk) {
+                    e->len = from - e->lblk;
+                } else {
+                    e->start += to - e->lblk;
+                    e->len = e_end - to;
+                    e->lblk = to;
+                }
+                k++;
+                continue;
+            }
+        }
+
+        //drop the entry for an empty child or a whole extent
+        memmove(e, e + 1, (node->hdr.count - k - 1) * sizeof(struct fs_extent));
+        node->hdr.count--;
+        changed = true;
+    }
+    if (changed) ext_node_write(inode, blkno, node);
+}
+
+/**
+ * Unmap a range of file blocks in an extent tree, freeing the blocks
+ * if requested. The caller must write the inode back.
+ *
+ * @param inode the inode
+ * @param lblk the first file block
+ * @param nblks the number of blocks
+ * @param free_blks true to free the unmapped blocks
+ * @return SUCCESS, or -ENOSPC if there may be no room to cut an extent
+ */
+static int ext_remove(struct fs_inode *inode, uint32_t lblk, uint32_t nblks, bool free_blks)
+{
+    //an extent cut in two inserts its upper part
+    if (num_free_blk() < inode->ext_hdr.depth + 2) return -ENOSPC;
+
+    struct fs_extent_node root;
+    struct fs_extent tail = {0};
+    ext_node_read(inode, 0, &root);
+    ext_node_remove(inode, 0, &root, lblk, lblk + nblks, free_blks, &tail);
+    if (root.hdr.count == 0 && root.hdr.depth > 0) {
+        root.hdr.depth = 0;
+        ext_node_write(inode, 0, &root);
+    }
+    return tail.len > 0 ? ext_insert(inode, &tail) : SUCCESS;
+}
+
+/**
+ * Mark the unwritten extents in a range of file blocks as written,
+ * ahead of writing the blocks. Until then the blocks are marked
+ * uninitialized, so a partial write zero-fills around its data.
+ * An extent reaching past the range is cut, which may split nodes;
+ * the room for that is checked before anything is changed. The
+ * caller must write the inode back.
+ *
+ * @param inode the inode
+ * @param lblk the first file block
+ * @param nblks the number of blocks
+ * @return SUCCESS, or -ENOSPC if there may be no room for new nodes
+ */
+static int ext_convert(struct fs_inode *inode, uint32_t lblk, uint32_t nblks)
+{
+    uint32_t end = lblk + nblks;
+    struct fs_extent e;
+
+    //only the extents at either end are cut, each inserting one extent
+    //and perhaps adding a level to the tree
+    int cuts = 0;
+    if (ext_next(inode, lblk, &e) && e.unwritten && e.lblk < lblk) cuts++;
+    if (ext_next(inode, end - 1, &e) && e.unwritten && e.lblk < end && e.lblk + e.len > end) {
+        cuts++;
+    }
+    if (cuts > 0 && num_free_blk() < cuts * (inode->ext_hdr.depth + 3) - 1) return -ENOSPC;
+
+    while (lblk < end && ext_next(inode, lblk, &e) && e.lblk < end) {
+        uint32_t from = e.lblk > lblk ? e.lblk : lblk;
+        uint32_t to = e.lblk + e.len < end ? e.lblk + e.len : end;
+        lblk = to;
+        if (!e.unwritten) continue;
+        for (uint32_t b = from; b < to; b++) {
+            bitmap_set(uninit_map, e.start + (b - e.lblk));
+        }
+
+        //a whole extent is marked in place; part of one is cut out
+        if (from == e.lblk && to == e.lblk + e.len) {
+            struct fs_extent_node node;
+            uint32_t next;
+            int blkno = ext_leaf(inode, from, &node, &next);
+            node.extents[ext_search(&node, from)].unwritten = 0;
+            ext_node_write(inode, blkno, &node);
+        } else {
+            struct fs_extent ext = {from, e.start + (from - e.lblk), to - from};
+            if (ext_remove(inode, from, to - from, false) < 0) exit(1);  // room checked above
+            if (ext_insert(inode, &ext) < 0) exit(1);
+        }
+    }
     return SUCCESS;
 }
 
+/**
+ * Map a range of file blocks of an extent-mapped inode, allocating
+ * missing blocks if requested as in fs_bmap(). Each contiguous piece
+ * of a run that fills a hole is added to the tree as one extent.
+ *
+ * @param inode_idx the inode number
+ * @param lblk the first file block number
+ * @param nblks the number of blocks to map
+ * @param pblks array to receive disk block numbers
+ * @param run the run to allocate missing blocks from, or NULL
+ * @return the number of blocks mapped
+ */
+static int ext_bmap(int inode_idx, int lblk, int nblks, uint32_t *pblks, struct blk_run *run)
+{
+    struct fs_inode *inode = &inodes[inode_idx];
+    int i = 0;
+    while (i < nblks) {
+        i += ext_map(inode, lblk + i, nblks - i, pblks + i);
+        if (i == nblks || run == NULL || lblk + i >= EXT_MAX_BLKS) break;
+
+        //fill the hole up to the next mapped block
+        struct fs_extent e;
+        int hole = nblks - i;
+        if (ext_next(inode, lblk + i, &e) && e.lblk - (lblk + i) < (uint32_t) hole) {
+            hole = e.lblk - (lblk + i);
+        }
+        if (hole > EXT_MAX_BLKS - (lblk + i)) hole = EXT_MAX_BLKS - (lblk + i);
+        int got, start = run_get_blks(run, hole, &got);
+        if (start < 0) break;
+        struct fs_extent ext = {lblk + i, start, got};
+        if (ext_insert(inode, &ext) < 0) {
+            //give the blocks back to the run, which frees them
+            run->next = start;
+            run->left += got;
+            break;
+        }
+        for (int k = 0; k < got; k++) {
+            bitmap_set(uninit_map, start + k);
+            pblks[i++] = start + k;
+        }
+    }
+    return i;
+}
+
+/**
+ * Free the blocks mapped under an extent tree node, and its
+ * child nodes.
+ *
+ * @param inode the inode
+ * @param node the node
+ */
+static void ext_free_node(struct fs_inode *inode, struct fs_extent_node *node)
+{
+    for (int k = 0; k < node->hdr.count; k++) {
+        struct fs_extent *e = &node->extents[k];
+        if (node->hdr.depth > 0) {
+            struct fs_extent_node child;
+            ext_node_read(inode, e->start, &child);
+            ext_free_node(inode, &child);
+            return_blk(e->start);
+        } else {
+            for (uint32_t j = 0; j < e->len; j++) {
+                return_blk(e->start + j);
+            }
+        }
+    }
+}
+
 static void fs_truncate_dir(uint32_t *de) {
     for (int i = 0; i < N_DIRECT; i++) {
         if (de[i]) return_blk(de[i]);
@@ -736,8 +2841,7 @@ static void fs_truncate_dir(uint32_t *de) {
 static void fs_truncate_indir1(int blk_num) {
     uint32_t entries[PTRS_PER_BLK];
     memset(entries, 0, PTRS_PER_BLK * sizeof(uint32_t));
-    if (disk->ops->read(disk, blk_num, 1, entries) < 0)
-        exit(1);
+    meta_read(blk_num, entries);
     //clear each blk and wipe from blk_map
     for (int i = 0; i < PTRS_PER_BLK; i++) {
         if (entries[i]) return_blk(entries[i]);
@@ -748,15 +2852,57 @@ static void fs_truncate_indir1(int blk_num) {
 static void fs_truncate_indir2(int blk_num) {
     uint32_t entries[PTRS_PER_BLK];
     memset(entries, 0, PTRS_PER_BLK * sizeof(uint32_t));
-    if (disk->ops->read(disk, blk_num, 1, entries) < 0)
-        exit(1);
+    meta_read(blk_num, entries);
     //clear each double link
     for (int i = 0; i < PTRS_PER_BLK; i++) {
-        if (entries[i]) fs_truncate_indir1(entries[i]);
+        if (entries[i]) {
+            fs_truncate_indir1(entries[i]);
+            return_blk(entries[i]);
+        }
         entries[i] = 0;
     }
 }
 
+/**
+ * Free all data and pointer blocks of a file or directory.
+ *
+ * @param inode the inode
+ */
+static void fs_free_blks(struct fs_inode *inode)
+{
+    bmap_cache_drop(inode - inodes);
+    resv_drop(inode - inodes);
+    delalloc_drop(inode - inodes);
+
+    //extent-mapped inodes stay extent-mapped, with an empty tree
+    if (inode->flags & FS_INODE_EXTENTS) {
+        struct fs_extent_node root;
+        ext_node_read(inode, 0, &root);
+        ext_free_node(inode, &root);
+        inode->flags &= ~FS_INODE_UNWRITTEN;
+        memset(&inode->ext_hdr, 0, sizeof(inode->ext_hdr));
+        memset(inode->extents, 0, sizeof(inode->extents));
+        return;
+    }
+
+    //clear direct
+    fs_truncate_dir(inode->direct);
+
+    //clear indirect1
+    if (inode->indir_1) {
+        fs_truncate_indir1(inode->indir_1);
+        return_blk(inode->indir_1);
+    }
+    inode->indir_1 = 0;
+
+    //clear indirect2
+    if (inode->indir_2) {
+        fs_truncate_indir2(inode->indir_2);
+        return_blk(inode->indir_2);
+    }
+    inode->indir_2 = 0;
+}
+
 /**
  * truncate - truncate file to exactly 'len' bytes.
  *
@@ -785,28 +2931,13 @@ static int fs_truncate(const char *path, off_t len)
     struct fs_inode *inode = &inodes[inode_idx];
     if (S_ISDIR(inode->mode)) return -EISDIR;
 
-    //clear direct
-    fs_truncate_dir(inode->direct);
-
-    //clear indirect1
-    if (inode->indir_1) {
-        fs_truncate_indir1(inode->indir_1);
-        return_blk(inode->indir_1);
-    }
-    inode->indir_1 = 0;
-
-    //clear indirect2
-    if (inode->indir_2) {
-        fs_truncate_indir2(inode->indir_2);
-        return_blk(inode->indir_2);
-    }
-    inode->indir_2 = 0;
-
+    fs_free_blks(inode);
     inode->size = 0;
+    fs_file_invalidate(inode_idx);
 
     //update at the end for efficiency
     update_inode(inode_idx);
-    update_blk();
+    flush_metadata_timed();
 
     return SUCCESS;
 }
@@ -837,20 +2968,11 @@ static int fs_unlink(const char *path)
     struct fs_inode *parent_inode = &inodes[parent_inode_idx];
     if (inode_idx < 0 || parent_inode_idx < 0) return -ENOENT;
     if (S_ISDIR(inode->mode)) return -EISDIR;
-    if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
-
-    //remove entire entry from parent dir
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
-    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        if (entries[i].valid && strcmp(entries[i].name, name) == 0) {
-            memset(&entries[i], 0, sizeof(struct fs_dirent));
-        }
-    }
-    if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
+    if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
+
+    //remove entire entry from parent dir
+    dir_remove(parent_inode_idx, name);
+    dcache_enter(dcache, parent_inode_idx, name, 0);
 
     //clear inode
     memset(inode, 0, sizeof(struct fs_inode));
@@ -858,7 +2980,7 @@ static int fs_unlink(const char *path)
 
     //update
     update_inode(inode_idx);
-    update_blk();
+    flush_metadata_timed();
 
     return SUCCESS;
 }
@@ -892,33 +3014,21 @@ static int fs_rmdir(const char *path)
     if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
 
     //check if dir if empty
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, inode->direct[0], 1, entries) < 0)
-        exit(1);
-    int res = is_empty_dir(entries);
-    if (res == 0) return -ENOTEMPTY;
+    if (!is_empty_dir(inode_idx)) return -ENOTEMPTY;
 
     //remove entry from parent dir
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
-    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        if (entries[i].valid && strcmp(entries[i].name, name) == 0) {
-            memset(&entries[i], 0, sizeof(struct fs_dirent));
-        }
-    }
-    if (disk->ops->write(disk, parent_inode->direct[0], 1, entries) < 0)
-        exit(1);
+    dir_remove(parent_inode_idx, name);
+    dcache_enter(dcache, parent_inode_idx, name, 0);
+    dcache_purge(dcache, inode_idx);
 
-    //return blk and clear inode
-    return_blk(inode->direct[0]);
+    //return blks and clear inode
+    fs_free_blks(inode);
     return_inode(inode_idx);
     memset(inode, 0, sizeof(struct fs_inode));
 
     //update
     update_inode(inode_idx);
-    update_blk();
+    flush_metadata_timed();
 
     return SUCCESS;
 }
@@ -968,20 +3078,19 @@ static int fs_rename(const char *src_path, const char *dst_path)
     struct fs_inode *parent_inode = &inodes[parent_inode_idx];
     if (!S_ISDIR(parent_inode->mode)) return -ENOTDIR;
 
-    struct fs_dirent entries[DIRENTS_PER_BLK];
-    memset(entries, 0, DIRENTS_PER_BLK * sizeof(struct fs_dirent));
-    if (disk->ops->read(disk, parent_inode->direct[0], 1, entries) < 0) exit(1);
-
-    //make change to buff
-    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        if (entries[i].valid && strcmp(entries[i].name, src_name) == 0) {
-            memset(entries[i].name, 0, sizeof(entries[i].name));
-            strcpy(entries[i].name, dst_name);
-        }
+    //the new name may hash to a different block, so remove and re-add
+    struct fs_dirent de;
+    if (!dir_find(parent_inode_idx, src_name, &de)) return -ENOENT;
+    dir_remove(parent_inode_idx, src_name);
+    int res = dir_add(parent_inode_idx, dst_name, de.inode, de.isDir);
+    if (res < 0) {
+        dir_add(parent_inode_idx, src_name, de.inode, de.isDir);
+        flush_metadata_timed();
+        return res;
     }
-
-    //write buff to inode
-    if (disk->ops->write(disk, parent_inode->direct[0], 1, entries)) exit(1);
+    flush_metadata_timed();
+    dcache_enter(dcache, parent_inode_idx, src_name, 0);
+    dcache_enter(dcache, parent_inode_idx, dst_name, src_inode_idx);
     return SUCCESS;
 }
 
@@ -1008,6 +3117,7 @@ static int fs_chmod(const char *path, mode_t mode)
     //change through reference
     inode->mode = mode;
     update_inode(inode_idx);
+    flush_metadata_timed();
     return SUCCESS;
 }
 
@@ -1031,89 +3141,531 @@ int fs_utime(const char *path, struct utimbuf *ut)
     //change through reference
     inode->mtime = ut->modtime;
     update_inode(inode_idx);
+    flush_metadata_timed();
     return SUCCESS;
 }
 
-static void fs_read_blk(int blk_num, char *buf, size_t len, size_t offset) {
-    char entries[BLOCK_SIZE];
-    memset(entries, 0, BLOCK_SIZE * sizeof(char));
-    if (disk->ops->read(disk, blk_num, 1, entries) < 0) exit(1);
-    memcpy(buf, entries + offset, len);
+/**
+ * Get the block map cache entry for an inode, replacing the entry
+ * of another inode that shares its slot.
+ *
+ * @param inum the inode number
+ * @return the cache entry
+ */
+static struct fs_bmap_cache *bmap_cache_get(int inum)
+{
+    struct fs_bmap_cache *bc = &bmap_cache[inum % BMAP_CACHE_INODES];
+    if (bc->inum != inum) {
+        bmap_cache_drop(bc->inum);
+        bc->inum = inum;
+    }
+    return bc;
+}
+
+/**
+ * Map file blocks through one block of pointers, allocating the
+ * pointer block and data blocks if requested. The pointer block
+ * is read into its cached copy on first use, and written through
+ * once if changed.
+ *
+ * @param ptr_blk the pointer block number, updated if allocated
+ * @param cached the cached copy of the pointer block, or NULL
+ * @param ptr_dirty set if *ptr_blk is allocated
+ * @param first index of first pointer to map
+ * @param nblks the number of blocks to map
+ * @param pblks array to receive disk block numbers
+ * @param run the run to allocate missing blocks from, or NULL
+ * @return the number of blocks mapped
+ */
+static int fs_bmap_ptrs(uint32_t *ptr_blk, uint32_t **cached, bool *ptr_dirty, int first,
+                        int nblks, uint32_t *pblks, struct blk_run *run)
+{
+    bool dirty = false;
+    if (!*ptr_blk) {
+        if (run == NULL) return 0;
+        int freeb = get_free_blk();
+        if (freeb < 0) return 0;
+        *ptr_blk = freeb;
+        *ptr_dirty = true;
+        dirty = true;
+        free(*cached);
+        *cached = calloc(PTRS_PER_BLK, sizeof(uint32_t));
+        if (*cached == NULL) exit(1);
+    } else if (*cached == NULL) {
+        *cached = malloc(FS_BLOCK_SIZE);
+        if (*cached == NULL) exit(1);
+        meta_read(*ptr_blk, *cached);
+    }
+    uint32_t *ptrs = *cached;
+
+    int i = 0;
+    while (i < nblks && first + i < PTRS_PER_BLK) {
+        if (!ptrs[first + i]) {
+            if (run == NULL) break;
+            int freeb = run_get_blk(run);
+            if (freeb < 0) break;
+            bitmap_set(uninit_map, freeb);
+            ptrs[first + i] = freeb;
+            dirty = true;
+        }
+        pblks[i] = ptrs[first + i];
+        i++;
+    }
+    if (dirty) meta_write(*ptr_blk, ptrs);
+    return i;
 }
 
-static size_t fs_read_dir(size_t inode_idx, char *buf, size_t len, size_t offset) {
+/**
+ * Map a range of file blocks of a pointer-mapped inode, allocating
+ * missing blocks if requested as in fs_bmap(). Pointer blocks are
+ * kept in the inode's block map cache, so each is read from disk
+ * only once.
+ *
+ * @param inode_idx the inode number
+ * @param lblk the first file block number
+ * @param nblks the number of blocks to map
+ * @param pblks array to receive disk block numbers
+ * @param run the run to allocate missing blocks from, or NULL
+ * @return the number of blocks mapped
+ */
+static int ptr_bmap(int inode_idx, int lblk, int nblks, uint32_t *pblks, struct blk_run *run)
+{
     struct fs_inode *inode = &inodes[inode_idx];
-    size_t blk_num = offset / BLOCK_SIZE;
-    size_t blk_offset = offset % BLOCK_SIZE;
-    size_t len_to_read = len;
-    while (blk_num < N_DIRECT && len_to_read > 0) {
-        size_t cur_len_to_read = len_to_read > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_read;
-        size_t temp = blk_offset + cur_len_to_read;
-
-        if (!inode->direct[blk_num]) {
-            return len - len_to_read;
+    bool inode_dirty = false;
+    int i = 0;
+
+    //direct blocks
+    for ( ; i < nblks && lblk + i < DIR_BLKS; i++) {
+        uint32_t *p = &inode->direct[lblk + i];
+        if (!*p) {
+            if (run == NULL) return i;
+            int freeb = run_get_blk(run);
+            if (freeb < 0) return i;
+            bitmap_set(uninit_map, freeb);
+            *p = freeb;
         }
+        pblks[i] = *p;
+    }
+    if (i == nblks) return i;
+    struct fs_bmap_cache *bc = bmap_cache_get(inode_idx);
+
+    //indirect 1 blocks
+    if (lblk + i < DIR_BLKS + INDIR1_BLKS) {
+        int first = lblk + i - DIR_BLKS;
+        int n = fs_bmap_ptrs(&inode->indir_1, &bc->indir_1, &inode_dirty, first,
+                             nblks - i, pblks + i, run);
+        i += n;
+        if (first + n < INDIR1_BLKS && i < nblks) return i;
+    }
 
-        fs_read_blk(inode->direct[blk_num], buf, temp, blk_offset);
+    //indirect 2 blocks
+    if (i < nblks && lblk + i < DIR_BLKS + INDIR1_BLKS + INDIR2_BLKS) {
+        bool dirty = false;
+        if (!inode->indir_2) {
+            if (run == NULL) return i;
+            int freeb = get_free_blk();
+            if (freeb < 0) return i;
+            inode->indir_2 = freeb;
+            dirty = true;
+            free(bc->indir_2);
+            bc->indir_2 = calloc(PTRS_PER_BLK, sizeof(uint32_t));
+            if (bc->indir_2 == NULL) exit(1);
+        } else if (bc->indir_2 == NULL) {
+            bc->indir_2 = malloc(FS_BLOCK_SIZE);
+            if (bc->indir_2 == NULL) exit(1);
+            meta_read(inode->indir_2, bc->indir_2);
+        }
+        uint32_t *ptrs = bc->indir_2;
+
+        while (i < nblks && lblk + i < DIR_BLKS + INDIR1_BLKS + INDIR2_BLKS) {
+            int idx = lblk + i - DIR_BLKS - INDIR1_BLKS;
+            int first = idx % PTRS_PER_BLK;
+            int n = fs_bmap_ptrs(&ptrs[idx / PTRS_PER_BLK], &bc->indir_2_blks[idx / PTRS_PER_BLK],
+                                 &dirty, first, nblks - i, pblks + i, run);
+            i += n;
+            if (first + n < PTRS_PER_BLK) break;
+        }
+        if (dirty) meta_write(inode->indir_2, ptrs);
+    }
+    return i;
+}
 
-        buf += temp;
-        len_to_read -= temp;
-        blk_num++;
-        blk_offset = 0;
+/**
+ * Map a range of file blocks to disk block numbers. Allocates
+ * missing blocks if requested, taking contiguous runs sized to the
+ * range from the file's reservation; the caller must write the
+ * inode back after allocating. Newly allocated data blocks are
+ * marked uninitialized rather than zeroed on disk.
+ *
+ * @param inode_idx the inode number
+ * @param lblk the first file block number
+ * @param nblks the number of blocks to map
+ * @param pblks array to receive disk block numbers
+ * @param alloc true to allocate missing blocks
+ * @return the number of blocks mapped, which stops short at the
+ *   first missing block or when the disk is full
+ */
+static int fs_bmap(int inode_idx, int lblk, int nblks, uint32_t *pblks, bool alloc)
+{
+    //new blocks go after the block before them, or near the parent
+    struct blk_run run = {inode_idx, nblks, blk_goal[inode_idx], 0, 0};
+    uint32_t prev;
+    if (alloc && lblk > 0 && fs_bmap(inode_idx, lblk - 1, 1, &prev, false) == 1) {
+        run.goal = prev + 1;
     }
-    return len - len_to_read;
+    struct blk_run *r = alloc ? &run : NULL;
+    int n = inodes[inode_idx].flags & FS_INODE_EXTENTS ?
+            ext_bmap(inode_idx, lblk, nblks, pblks, r) :
+            ptr_bmap(inode_idx, lblk, nblks, pblks, r);
+    run_put(&run);
+    return n;
 }
 
-static size_t fs_read_indir1(size_t blk, char *buf, size_t len, size_t offset) {
-    uint32_t blk_indices[PTRS_PER_BLK];
-    memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-    if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) exit(1);
+/**
+ * Map file blocks for reading through an open file. Blocks are
+ * mapped up to FILE_MAP_BLKS at a time, or to the end of file, and
+ * kept in the open file so sequential reads skip the pointer blocks.
+ *
+ * @param f the open file, or NULL
+ * @param inode_idx the inode number
+ * @param lblk the first file block number
+ * @param nblks the number of blocks to map
+ * @param pblks array to receive disk block numbers
+ * @return the number of blocks mapped
+ */
+static int fs_file_bmap(struct fs_file *f, int inode_idx, int lblk, int nblks, uint32_t *pblks)
+{
+    if (f == NULL || nblks > FILE_MAP_BLKS) {
+        return fs_bmap(inode_idx, lblk, nblks, pblks, false);
+    }
+    if (lblk < f->map_lblk || lblk + nblks > f->map_lblk + f->map_nblks) {
+        int eof_blks = (inodes[inode_idx].size + BLOCK_SIZE - 1) / BLOCK_SIZE - lblk;
+        int window = eof_blks < FILE_MAP_BLKS ? eof_blks : FILE_MAP_BLKS;
+        if (window < nblks) window = nblks;
+        f->map_lblk = lblk;
+        f->map_nblks = fs_bmap(inode_idx, lblk, window, f->map, false);
+    }
+    int n = f->map_lblk + f->map_nblks - lblk;
+    if (n > nblks) n = nblks;
+    if (n < 0) n = 0;
+    memcpy(pblks, &f->map[lblk - f->map_lblk], n * sizeof(uint32_t));
+    return n;
+}
 
-    size_t blk_num = offset / BLOCK_SIZE;
-    size_t blk_offset = offset % BLOCK_SIZE;
-    size_t len_to_read = len;
-    while (blk_num < PTRS_PER_BLK && len_to_read > 0) {
-        size_t cur_len_to_read = len_to_read > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_read;
-        size_t temp = blk_offset + cur_len_to_read;
+/**
+ * Queue a read of part of a block. A whole block is read directly
+ * into the buffer; otherwise it is read into a bounce buffer and
+ * the requested part is copied when the batch completes.
+ *
+ * @param b the batch
+ * @param blk_num the block number
+ * @param buf the destination buffer
+ * @param len the number of bytes to read
+ * @param offset the offset within the block
+ */
+static void fs_read_blk(struct io_batch *b, int blk_num, char *buf, size_t len, size_t offset) {
+    if (offset == 0 && len == BLOCK_SIZE) {
+        batch_add(b, BLKDEV_READ, blk_num, buf);
+    } else {
+        batch_add(b, BLKDEV_READ, blk_num, batch_bounce(b, buf, offset, len));
+    }
+}
 
-        if (!blk_indices[blk_num]) {
-            return len - len_to_read;
-        }
+/**
+ * Queue a write of part of a block. A whole block is written directly
+ * from the buffer; otherwise the block is updated in a bounce buffer
+ * that is written when the batch completes. Only a partial write to
+ * an initialized block reads the old contents; an uninitialized block
+ * is zero-filled around the new data.
+ *
+ * @param b the batch
+ * @param blk_num the block number
+ * @param buf the source buffer
+ * @param len the number of bytes to write
+ * @param offset the offset within the block
+ */
+static void fs_write_blk(struct io_batch *b, int blk_num, const char *buf, size_t len, size_t offset) {
+    bool uninit = bitmap_test(uninit_map, blk_num);
+    bitmap_clear(uninit_map, blk_num);
+    if (uninit) uninit_written = true;
+    if (offset == 0 && len == BLOCK_SIZE) {
+        batch_add(b, BLKDEV_WRITE, blk_num, (char*) buf);
+        return;
+    }
+    char *bounce = batch_bounce(b, NULL, 0, 0);
+    if (uninit) {
+        memset(bounce, 0, BLOCK_SIZE);
+    } else if (disk->ops->read(disk, blk_num, 1, bounce) < 0) {
+        exit(1);
+    }
+    memcpy(bounce + offset, buf, len);
+    batch_add(b, BLKDEV_WRITE, blk_num, bounce);
+}
 
-        fs_read_blk(blk_indices[blk_num], buf, temp, blk_offset);
+/**
+ * Queue transfers of file data for mapped blocks. Each run of whole
+ * blocks at consecutive disk addresses becomes one multi-block
+ * request; partial blocks at either end are transferred singly.
+ * Uninitialized blocks are read as zeros without any I/O.
+ *
+ * @param b the batch
+ * @param op BLKDEV_READ or BLKDEV_WRITE
+ * @param pblks disk block numbers of the file blocks
+ * @param nblks the number of blocks
+ * @param buf the data buffer
+ * @param len the number of bytes to transfer
+ * @param offset the offset within the first block
+ * @return the number of bytes queued
+ */
+static size_t fs_queue_runs(struct io_batch *b, int op, uint32_t *pblks, int nblks,
+                            char *buf, size_t len, size_t offset)
+{
+    size_t pos = 0;
+    int k = 0;
+    while (k < nblks && pos < len) {
+        size_t cur = len - pos > BLOCK_SIZE - offset ? BLOCK_SIZE - offset : len - pos;
+        if (op == BLKDEV_READ && bitmap_test(uninit_map, pblks[k])) {
+            memset(buf + pos, 0, cur);
+            pos += cur;
+            offset = 0;
+            k++;
+            continue;
+        }
+        if (cur < BLOCK_SIZE) {
+            if (op == BLKDEV_READ) fs_read_blk(b, pblks[k], buf + pos, cur, offset);
+            else fs_write_blk(b, pblks[k], buf + pos, cur, offset);
+            pos += cur;
+            offset = 0;
+            k++;
+            continue;
+        }
 
-        buf += temp;
-        len_to_read -= temp;
-        blk_num++;
-        blk_offset = 0;
+        //run of whole blocks at consecutive disk addresses
+        int run = 1;
+        while (k + run < nblks && pblks[k + run] == pblks[k] + run
+               && len - pos >= (size_t) (run + 1) * BLOCK_SIZE
+               && !(op == BLKDEV_READ && bitmap_test(uninit_map, pblks[k + run]))) {
+            run++;
+        }
+        if (op == BLKDEV_WRITE) {
+            for (int i = 0; i < run; i++) {
+                if (bitmap_test(uninit_map, pblks[k + i])) uninit_written = true;
+                bitmap_clear(uninit_map, pblks[k + i]);
+            }
+        }
+        batch_add_run(b, op, pblks[k], run, buf + pos);
+        pos += (size_t) run * BLOCK_SIZE;
+        k += run;
     }
-    return len - len_to_read;
+    return pos;
+}
+
+/**
+ * Allocate and write the blocks buffered in a delayed allocation
+ * slot. The whole range is mapped at once, so it is allocated as
+ * one run where the disk allows. The reservation should leave room
+ * for every block; blocks that still cannot be allocated stay
+ * buffered, and the next fsync fails.
+ *
+ * @param d the slot
+ * @return SUCCESS, or -EIO if blocks could not be allocated
+ */
+static int delalloc_flush(struct fs_delalloc *d)
+{
+    //release the reservation first, so the blocks can be allocated
+    int inum = d->inum, lblk = d->lblk, nblks = d->nblks;
+    d->inum = 0;
+    d->nblks = 0;
+    if (nblks == 0) return SUCCESS;
+
+    uint32_t pblks[DELALLOC_MAX_BLKS];
+    int mapped = fs_bmap(inum, lblk, nblks, pblks, true);
+    struct io_batch b = {0};
+    fs_queue_runs(&b, BLKDEV_WRITE, pblks, mapped, d->data, (size_t) mapped * BLOCK_SIZE, 0);
+    batch_flush(&b);
+    update_inode(inum);
+    if (mapped == nblks) return SUCCESS;
+
+    //keep the rest, which reads still see, for the next flush
+    fprintf(stderr, "delayed allocation: no room for %d blocks of inode %d\n", nblks - mapped, inum);
+    d->inum = inum;
+    d->lblk = lblk + mapped;
+    d->nblks = nblks - mapped;
+    memmove(d->data, d->data + (size_t) mapped * BLOCK_SIZE, (size_t) d->nblks * BLOCK_SIZE);
+    delalloc_status = -EIO;
+    return -EIO;
 }
 
-static size_t fs_read_indir2(size_t blk, char *buf, size_t len, size_t offset) {
-    uint32_t blk_indices[PTRS_PER_BLK];
-    memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-    if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) return 0;
+/**
+ * Allocate and write all blocks buffered for delayed allocation.
+ */
+static void delalloc_flush_all(void)
+{
+    for (int i = 0; i < DELALLOC_INODES; i++) {
+        delalloc_flush(&delalloc[i]);
+    }
+}
 
-    size_t blk_num = offset / INDIR1_SIZE;
-    size_t blk_offset = offset % INDIR1_SIZE;
-    size_t len_to_read = len;
-    while (blk_num < PTRS_PER_BLK && len_to_read > 0) {
-        size_t cur_len_to_read = len_to_read > INDIR1_SIZE ? (size_t) INDIR1_SIZE - blk_offset : len_to_read;
-        size_t temp = blk_offset + cur_len_to_read;
+/**
+ * Buffer a write to file blocks not yet allocated. The blocks are
+ * allocated when metadata is next flushed, so many small appends
+ * become one allocation, and a file deleted before then never uses
+ * any. A write that does not fall within or just after the buffered
+ * range, or would overfill it, flushes the buffer instead.
+ *
+ * @param inum the inode number
+ * @param offset the offset to write at, in a block not allocated
+ * @param buf the data to write
+ * @param len the number of bytes to write
+ * @return the number of bytes buffered, 0 to allocate the blocks now,
+ *   or -ENOSPC if buffered blocks could not be allocated
+ */
+static int delalloc_write(int inum, off_t offset, const char *buf, size_t len)
+{
+    struct fs_delalloc *d = &delalloc[inum % DELALLOC_INODES];
+    int lblk = (int) (offset / BLOCK_SIZE);
+    int end = (int) ((offset + len - 1) / BLOCK_SIZE) + 1;
+
+    //another file's range, or a write outside this one or more than
+    //it holds, is flushed; an append after it starts a new range
+    if (d->nblks > 0 && (d->inum != inum || lblk < d->lblk || lblk > d->lblk + d->nblks
+                         || end > d->lblk + DELALLOC_MAX_BLKS)) {
+        bool restart = d->inum != inum || lblk == d->lblk + d->nblks;
+        if (delalloc_flush(d) < 0) return -ENOSPC;
+        if (!restart) return 0;
+    }
+    if (d->nblks == 0) {
+        if (end - lblk > DELALLOC_MAX_BLKS / 2) return 0;
+        if (d->data == NULL && (d->data = malloc(DELALLOC_MAX_BLKS * BLOCK_SIZE)) == NULL) return 0;
+        d->inum = inum;
+        d->lblk = lblk;
+    }
 
-        if (!blk_indices[blk_num]) {
-            return len - len_to_read;
+    //reserve the new blocks, which start out zeroed; blocks mapped
+    //past a hole in an extent-mapped file are written in place
+    int more = end - (d->lblk + d->nblks);
+    if (more > 0) {
+        struct fs_extent e;
+        if (num_free_blk() < more + more / PTRS_PER_BLK + 3 ||
+            ((inodes[inum].flags & FS_INODE_EXTENTS) &&
+             ext_next(&inodes[inum], d->lblk + d->nblks, &e) && e.lblk < (uint32_t) end)) {
+            return delalloc_flush(d) < 0 ? -ENOSPC : 0;
         }
+        memset(d->data + (size_t) d->nblks * BLOCK_SIZE, 0, (size_t) more * BLOCK_SIZE);
+        d->nblks += more;
+    }
+    memcpy(d->data + (offset - (off_t) d->lblk * BLOCK_SIZE), buf, len);
+    return (int) len;
+}
+
+/**
+ * Read file data buffered for delayed allocation.
+ *
+ * @param inum the inode number
+ * @param offset the offset to read at
+ * @param buf the read buffer
+ * @param len the number of bytes to read
+ * @return the number of bytes read, which stops short at the end of the buffered range
+ */
+static size_t delalloc_read(int inum, off_t offset, char *buf, size_t len)
+{
+    struct fs_delalloc *d = &delalloc[inum % DELALLOC_INODES];
+    off_t start = (off_t) d->lblk * BLOCK_SIZE;
+    off_t end = start + (off_t) d->nblks * BLOCK_SIZE;
+    if (d->inum != inum || d->nblks == 0 || offset < start || offset >= end) return 0;
+    if (offset + (off_t) len > end) len = (size_t) (end - offset);
+    memcpy(buf, d->data + (offset - start), len);
+    return len;
+}
 
-        temp = fs_read_indir1(blk_indices[blk_num], buf, temp, blk_offset);
+/**
+ * Read a hole punched in an extent-mapped file, which reads as zeros
+ * up to the next mapped or buffered block.
+ *
+ * @param inum the inode number
+ * @param offset the offset to read at, in a block not mapped or buffered
+ * @param buf the read buffer
+ * @param len the number of bytes to read
+ * @return the number of bytes read, or 0 if the file has no holes
+ */
+static size_t fs_read_hole(int inum, off_t offset, char *buf, size_t len)
+{
+    struct fs_inode *inode = &inodes[inum];
+    if (!(inode->flags & FS_INODE_EXTENTS)) return 0;
+    struct fs_extent e;
+    off_t end = ext_next(inode, (uint32_t) (offset / BLOCK_SIZE), &e) ?
+                (off_t) e.lblk * BLOCK_SIZE : (off_t) EXT_MAX_BLKS * BLOCK_SIZE;
+    struct fs_delalloc *d = &delalloc[inum % DELALLOC_INODES];
+    if (d->inum == inum && d->nblks > 0 && (off_t) d->lblk * BLOCK_SIZE > offset &&
+        (off_t) d->lblk * BLOCK_SIZE < end) {
+        end = (off_t) d->lblk * BLOCK_SIZE;
+    }
+    if (end - offset < (off_t) len) len = (size_t) (end - offset);
+    memset(buf, 0, len);
+    return len;
+}
 
-        buf += temp;
-        len_to_read -= temp;
-        blk_num++;
-        blk_offset = 0;
+/**
+ * Update the readahead window of an open file after a read, and
+ * start reading the blocks following the window into the block
+ * cache. A read that does not start where the last one ended turns
+ * readahead off until reads are sequential again; each sequential
+ * read doubles the window up to RA_MAX_BLKS.
+ *
+ * @param f the open file
+ * @param offset the offset of the read
+ * @param len the number of bytes read
+ */
+static void fs_file_readahead(struct fs_file *f, off_t offset, size_t len)
+{
+    struct fs_inode *inode = &inodes[f->inum];
+    int lblk = (int) (offset / BLOCK_SIZE);
+    int end = (int) ((offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    //count blocks that were read ahead
+    int lo = lblk > f->ra_start ? lblk : f->ra_start;
+    int hi = end < f->ra_end ? end : f->ra_end;
+    if (hi > lo) ra_hits += hi - lo;
+
+    if (offset != f->next_offset) {
+        f->ra_blks = 0;
+        return;
+    }
+    if (f->ra_blks == 0) {
+        f->ra_blks = end - lblk > RA_MIN_BLKS ? end - lblk : RA_MIN_BLKS;
+    } else if (f->ra_blks < RA_MAX_BLKS) {
+        f->ra_blks *= 2;
     }
-    return len - len_to_read;
+    if (f->ra_blks > RA_MAX_BLKS) f->ra_blks = RA_MAX_BLKS;
+
+    //read ahead the blocks not yet read ahead, up to the window or EOF
+    int start = end > f->ra_end ? end : f->ra_end;
+    int eof = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int stop = end + f->ra_blks < eof ? end + f->ra_blks : eof;
+    if (stop - start < f->ra_blks / 2) return;
+    if (f->ra_buf == NULL && (f->ra_buf = malloc(RA_MAX_BLKS * BLOCK_SIZE)) == NULL) return;
+
+    uint32_t pblks[RA_MAX_BLKS];
+    int n = fs_bmap(f->inum, start, stop - start, pblks, false);
+    int k = 0;
+    while (k < n && f->ra_nreqs < RA_MAX_REQS) {
+        int run = 1;
+        while (k + run < n && pblks[k + run] == pblks[k] + run) run++;
+        struct blkdev_req *req = &f->ra_reqs[f->ra_nreqs++];
+        memset(req, 0, sizeof(*req));
+        req->op = BLKDEV_READ;
+        req->first_blk = pblks[k];
+        req->num_blks = run;
+        req->buf = f->ra_buf + k * BLOCK_SIZE;
+        k += run;
+    }
+    if (f->ra_nreqs > 0 && blkdev_submit(disk, f->ra_reqs, f->ra_nreqs) < 0) {
+        f->ra_nreqs = 0;
+        return;
+    }
+    if (start != f->ra_end) f->ra_start = start;
+    f->ra_end = start + k;
+    ra_prefetched += k;
 }
 
 /**
@@ -1138,8 +3690,8 @@ static size_t fs_read_indir2(size_t blk, char *buf, size_t len, size_t offset) {
 static int fs_read(const char *path, char *buf, size_t len, off_t offset,
 		    struct fuse_file_info *fi)
 {
-    char *_path = strdup(path);
-    int inode_idx = translate(_path);
+    struct fs_file *f = fs_file_get(fi);
+    int inode_idx = f != NULL ? f->inum : translate_path(path);
     if (inode_idx < 0) return inode_idx;
     struct fs_inode *inode = &inodes[inode_idx];
     if (S_ISDIR(inode->mode)) return -EISDIR;
@@ -1149,134 +3701,38 @@ static int fs_read(const char *path, char *buf, size_t len, off_t offset,
     if (offset + len > inode->size) {
         len = (size_t) inode->size - offset;
     }
-
-    //len need to read
-    size_t len_to_read = len;
-
-    //read direct blocks
-    if (len_to_read > 0 && offset < DIR_SIZE) {
-        //len finished read
-        size_t temp = fs_read_dir(inode_idx, buf, len_to_read, (size_t) offset);
-        len_to_read -= temp;
-        offset += temp;
-        buf += temp;
-    }
-
-    //read indirect 1 blocks
-    if (len_to_read > 0 && offset < DIR_SIZE + INDIR1_SIZE) {
-        //len finished read
-        size_t temp = fs_read_indir1(inode->indir_1, buf, len_to_read, (size_t) offset - DIR_SIZE);
-        len_to_read -= temp;
-        offset += temp;
-        buf += temp;
-    }
-
-    //read indirect 2 blocks
-    if (len_to_read > 0 && offset < DIR_SIZE + INDIR1_SIZE + INDIR2_SIZE) {
-        //len finshed read
-        size_t temp = fs_read_indir2(inode->indir_2, buf, len_to_read, (size_t) offset - DIR_SIZE - INDIR1_SIZE);
-        len_to_read -= temp;
-        offset += temp;
-        buf += temp;
-    }
-
-    return (int) (len - len_to_read);
-}
-
-static void fs_write_blk(int blk_num, const char *buf, size_t len, size_t offset) {
-    char entries[BLOCK_SIZE];
-    memset(entries, 0, BLOCK_SIZE * sizeof(char));
-    if (disk->ops->read(disk, blk_num, 1, entries) < 0) exit(1);
-    memcpy(entries + offset, buf, len);
-    if (disk->ops->write(disk, blk_num, 1, entries) < 0) exit(1);
-}
-
-static size_t fs_write_dir(size_t inode_idx, const char *buf, size_t len, size_t offset) {
-    struct fs_inode *inode = &inodes[inode_idx];
-
-    size_t blk_num = offset / BLOCK_SIZE;
-    size_t blk_offset = offset % BLOCK_SIZE;
-    size_t len_to_write = len;
-    while (blk_num < N_DIRECT && len_to_write > 0) {
-        size_t cur_len_to_write = len_to_write > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_write;
-        size_t temp = blk_offset + cur_len_to_write;
-
-        if (!inode->direct[blk_num]) {
-            int freeb = get_free_blk();
-            if (freeb < 0) return len - len_to_write;
-            inode->direct[blk_num] = freeb;
-            update_inode(inode_idx);
-        }
-
-        fs_write_blk(inode->direct[blk_num], buf, temp, blk_offset);
-
-        buf += temp;
-        len_to_write -= temp;
-        blk_num++;
-        blk_offset = 0;
-    }
-    return len - len_to_write;
-}
-
-static size_t fs_write_indir1(size_t blk, const char *buf, size_t len, size_t offset) {
-    uint32_t blk_indices[PTRS_PER_BLK];
-    memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-    if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) exit(1);
-
-    size_t blk_num = offset / BLOCK_SIZE;
-    size_t blk_offset = offset % BLOCK_SIZE;
-    size_t len_to_write = len;
-    while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
-        size_t cur_len_to_write = len_to_write > BLOCK_SIZE ? (size_t) BLOCK_SIZE - blk_offset : len_to_write;
-        size_t temp = blk_offset + cur_len_to_write;
-
-        if (!blk_indices[blk_num]) {
-            int freeb = get_free_blk();
-            if (freeb < 0) return len - len_to_write;
-            blk_indices[blk_num] = freeb;
-            //write back
-            if (disk->ops->write(disk, blk, 1, blk_indices) < 0)
-                exit(1);
-        }
-
-        fs_write_blk(blk_indices[blk_num], buf, temp, blk_offset);
-
-        buf += temp;
-        len_to_write -= temp;
-        blk_num++;
-        blk_offset = 0;
+    if (len == 0) return 0;
+
+    //map the file blocks, then queue one request per run
+    int nblks = (int) ((offset + len - 1) / BLOCK_SIZE) - (int) (offset / BLOCK_SIZE) + 1;
+    uint32_t *pblks = malloc(nblks * sizeof(uint32_t));
+    if (f != NULL) fs_file_ra_wait(f);
+    size_t done = 0;
+    while (done < len) {
+        off_t pos = offset + done;
+        int lblk = (int) (pos / BLOCK_SIZE);
+        nblks = (int) ((offset + len - 1) / BLOCK_SIZE) - lblk + 1;
+        int mapped = fs_file_bmap(f, inode_idx, lblk, nblks, pblks);
+        struct io_batch b = {0};
+        done += fs_queue_runs(&b, BLKDEV_READ, pblks, mapped, buf + done, len - done,
+                              (size_t) (pos % BLOCK_SIZE));
+        batch_flush(&b);
+        if (done == len) break;
+
+        //blocks past the mapped ones may still be buffered
+        pos = offset + done;
+        size_t n = delalloc_read(inode_idx, pos, buf + done, len - done);
+        if (n == 0) n = fs_read_hole(inode_idx, pos, buf + done, len - done);
+        if (n == 0) break;
+        done += n;
     }
-    return len - len_to_write;
-}
-
-static size_t fs_write_indir2(size_t blk, const char *buf, size_t len, size_t offset) {
-    uint32_t blk_indices[PTRS_PER_BLK];
-    memset(blk_indices, 0, PTRS_PER_BLK * sizeof(uint32_t));
-    if (disk->ops->read(disk, (int) blk, 1, blk_indices) < 0) return 0;
-
-    size_t blk_num = offset / INDIR1_SIZE;
-    size_t blk_offset = offset % INDIR1_SIZE;
-    size_t len_to_write = len;
-    while (blk_num < PTRS_PER_BLK && len_to_write > 0) {
-        size_t cur_len_to_write = len_to_write > INDIR1_SIZE ? (size_t) INDIR1_SIZE - blk_offset : len_to_write;
-        size_t temp = blk_offset + cur_len_to_write;
-        len_to_write -= temp;
-        if (!blk_indices[blk_num]) {
-            int freeb = get_free_blk();
-            if (freeb < 0) return len - len_to_write;
-            blk_indices[blk_num] = freeb;
-            //write back
-            if (disk->ops->write(disk, blk, 1, blk_indices) < 0)
-                exit(1);
-        }
+    free(pblks);
 
-        temp = fs_write_indir1(blk_indices[blk_num], buf, temp, blk_offset);
-        if (temp == 0) return len - len_to_write;
-        buf += temp;
-        blk_num++;
-        blk_offset = 0;
+    if (f != NULL) {
+        if (ra_enabled) fs_file_readahead(f, offset, done);
+        f->next_offset = offset + done;
     }
-    return len - len_to_write;
+    return (int) done;
 }
 
 /**
@@ -1301,62 +3757,60 @@ static size_t fs_write_indir2(size_t blk, const char *buf, size_t len, size_t of
 static int fs_write(const char *path, const char *buf, size_t len,
 		     off_t offset, struct fuse_file_info *fi)
 {
-    char *_path = strdup(path);
-    int inode_idx = translate(_path);
+    struct fs_file *f = fs_file_get(fi);
+    int inode_idx = f != NULL ? f->inum : translate_path(path);
     if (inode_idx < 0) return inode_idx;
     struct fs_inode *inode = &inodes[inode_idx];
     if (S_ISDIR(inode->mode)) return -EISDIR;
     if (offset > inode->size) return 0;
 
-    //len need to write
-    size_t len_to_write = len;
+    if (len == 0) return 0;
 
-    //write direct blocks
-    if (len_to_write > 0 && offset < DIR_SIZE) {
-        //len finished write
-        size_t temp = fs_write_dir(inode_idx, buf, len_to_write, (size_t) offset);
-        len_to_write -= temp;
-        offset += temp;
-        buf += temp;
-    }
+    //readahead must not complete over newly written data
+    fs_file_ra_wait_inode(inode_idx);
 
-    //write indirect 1 blocks
-    if (len_to_write > 0 && offset < DIR_SIZE + INDIR1_SIZE) {
-        //need to allocate indir_1
-        if (!inode->indir_1) {
-            int freeb = get_free_blk();
-            if (freeb < 0) return len - len_to_write;
-            inode->indir_1 = freeb;
-            update_inode(inode_idx);
-        }
-        size_t temp = fs_write_indir1(inode->indir_1, buf, len_to_write, (size_t) offset - DIR_SIZE);
-        len_to_write -= temp;
-        offset += temp;
-        buf += temp;
+    //map the file blocks, allocating new ones, then queue one request per run;
+    //with delayed allocation, only blocks already allocated are mapped
+    int lblk = (int) (offset / BLOCK_SIZE);
+    int nblks = (int) ((offset + len - 1) / BLOCK_SIZE) - lblk + 1;
+    if ((inode->flags & FS_INODE_UNWRITTEN) && ext_convert(inode, lblk, nblks) < 0) {
+        return -ENOSPC;
     }
-
-    //write indirect 2 blocks
-    if (len_to_write > 0 && offset < DIR_SIZE + INDIR1_SIZE + INDIR2_SIZE) {
-        //need to allocate indir_2
-        if (!inode->indir_2) {
-            int freeb = get_free_blk();
-            if (freeb < 0) return len - len_to_write;
-            inode->indir_2 = freeb;
-            update_inode(inode_idx);
+    uint32_t *pblks = malloc(nblks * sizeof(uint32_t));
+    int mapped = fs_bmap(inode_idx, lblk, nblks, pblks, !delalloc_mode);
+
+    struct io_batch b = {0};
+    size_t done = fs_queue_runs(&b, BLKDEV_WRITE, pblks, mapped, (char*) buf, len,
+                                (size_t) (offset % BLOCK_SIZE));
+    batch_flush(&b);
+
+    //buffer the rest, or allocate it now if it cannot be buffered
+    if (delalloc_mode && done < len) {
+        int more = delalloc_write(inode_idx, offset + done, buf + done, len - done);
+        if (more == 0) {
+            lblk = (int) ((offset + done) / BLOCK_SIZE);
+            nblks = (int) ((offset + len - 1) / BLOCK_SIZE) - lblk + 1;
+            mapped = fs_bmap(inode_idx, lblk, nblks, pblks, true);
+            more = (int) fs_queue_runs(&b, BLKDEV_WRITE, pblks, mapped, (char*) buf + done,
+                                       len - done, (size_t) ((offset + done) % BLOCK_SIZE));
+            batch_flush(&b);
         }
-        //len finshed write
-        size_t temp = fs_write_indir2(inode->indir_2, buf, len_to_write, (size_t) offset - DIR_SIZE - INDIR1_SIZE);
-        len_to_write -= temp;
-        offset += len_to_write;
+        if (more > 0) done += more;
     }
+    free(pblks);
 
+    offset += done;
     if (offset > inode->size) inode->size = offset;
+    if (f != NULL) {
+        f->next_offset = offset;
+        f->written = true;
+    }
 
     //update inode and blk
     update_inode(inode_idx);
-    update_blk();
+    flush_metadata_timed();
 
-    return (int) (len - len_to_write);
+    return done == 0 ? -ENOSPC : (int) done;
 }
 
 /**
@@ -1371,11 +3825,10 @@ static int fs_write(const char *path, const char *buf, size_t len,
  */
 static int fs_open(const char *path, struct fuse_file_info *fi)
 {
-    char *_path = strdup(path);
-    int inode_idx = translate(_path);
+    int inode_idx = translate_path(path);
     if (inode_idx < 0) return inode_idx;
     if (S_ISDIR(inodes[inode_idx].mode)) return -EISDIR;
-    fi->fh = (uint64_t) inode_idx;
+    fi->fh = (uint64_t) fs_file_alloc(inode_idx);
     return SUCCESS;
 }
 
@@ -1383,18 +3836,22 @@ static int fs_open(const char *path, struct fuse_file_info *fi)
  * Release resources created by pending open call.
  *
  * Errors:
- *   -ENOENT  - file does not exist
- *   -ENOTDIR - component of path not a directory
+ *   -EBADF   - not an open file handle
  *
  * @param path the file name
  * @param fi the fuse file info
  */
 static int fs_release(const char *path, struct fuse_file_info *fi)
 {
-    char *_path = strdup(path);
-    int inode_idx = translate(_path);
-    if (inode_idx < 0) return inode_idx;
-    if (S_ISDIR(inodes[inode_idx].mode)) return -EISDIR;
+    struct fs_file *f = fs_file_get(fi);
+    if (f == NULL) return -EBADF;
+    fs_file_ra_wait(f);
+    free(f->ra_buf);
+
+    //blocks reserved for more writes are free for other files; the
+    //data is made durable by fsync, not by close
+    if (f->written) resv_drop(f->inum);
+    f->inum = -1;
     fi->fh = (uint64_t) -1;
     return SUCCESS;
 }
@@ -1425,37 +3882,338 @@ static int fs_statfs(const char *path, struct statvfs *st)
     //clear original stats
     memset(st, 0, sizeof(*st));
     st->f_bsize = FS_BLOCK_SIZE;
-    st->f_blocks = (fsblkcnt_t) (n_blocks - root_inode - inode_base);
+    st->f_blocks = (fsblkcnt_t) (n_blocks - n_meta_blks);
     st->f_bfree = (fsblkcnt_t) num_free_blk();
     st->f_bavail = st->f_bfree;
+    st->f_files = (fsfilcnt_t) n_inodes;
+    st->f_ffree = (fsfilcnt_t) n_free_inodes;
+    st->f_favail = st->f_ffree;
     st->f_namemax = FS_FILENAME_SIZE - 1;
 
     return 0;
 }
 
+/**
+ * fsync - flush file contents and metadata to disk.
+ *
+ * Writes back the dirty inode and bitmap blocks, then flushes the
+ * disk, which writes back any blocks held by a write-back cache.
+ * Concurrent fsync calls are committed by a single disk flush.
+ *
+ * Errors
+ *   -EIO  - the disk flush failed
+ *
+ * @param path the file path
+ * @param datasync nonzero to flush only user data
+ * @param fi fuse file info
+ * @return 0 if successful
+ */
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return fs_sync();
+}
+
+/**
+ * fsyncdir - flush directory contents and metadata to disk.
+ *
+ * Directory blocks are written like file blocks, so this is the
+ * same as fsync, and shares its group commit.
+ *
+ * Errors
+ *   -EIO  - the disk flush failed
+ *
+ * @param path the directory path
+ * @param datasync nonzero to flush only directory data
+ * @param fi fuse file info
+ * @return 0 if successful
+ */
+static int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return fs_sync();
+}
+
+#if FUSE_VERSION >= 29
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+/** blocks mapped per step of fallocate */
+enum {FALLOC_MAP_BLKS = 1024};
+
+/** zeros written by fallocate, one block per mapped block */
+static char falloc_zeros[FALLOC_MAP_BLKS * BLOCK_SIZE];
+
+/**
+ * Write zeros over a byte range of a file. Unmapped blocks, and
+ * uninitialized ones such as those of unwritten extents, already
+ * read as zeros and are skipped.
+ *
+ * @param inode_idx the inode number
+ * @param offset the start of the range
+ * @param end the end of the range, at most the file size
+ */
+static void fs_zero_range(int inode_idx, off_t offset, off_t end)
+{
+    uint32_t pblks[FALLOC_MAP_BLKS];
+    struct io_batch b = {0};
+    while (offset < end) {
+        int lblk = (int) (offset / BLOCK_SIZE);
+        int nblks = (int) ((end - 1) / BLOCK_SIZE) - lblk + 1;
+        if (nblks > FALLOC_MAP_BLKS) nblks = FALLOC_MAP_BLKS;
+        int mapped = fs_bmap(inode_idx, lblk, nblks, pblks, false);
+        if (mapped == 0) break;
+        for (int k = 0; k < mapped && offset < end; k++) {
+            size_t pos = (size_t) (offset % BLOCK_SIZE);
+            size_t len = end - offset < (off_t) (BLOCK_SIZE - pos) ? (size_t) (end - offset) : BLOCK_SIZE - pos;
+            if (!bitmap_test(uninit_map, pblks[k])) {
+                fs_write_blk(&b, pblks[k], falloc_zeros + (size_t) k * BLOCK_SIZE, len, pos);
+            }
+            offset += len;
+        }
+        batch_flush(&b);
+    }
+}
+
+/**
+ * Allocate the unmapped blocks in a range of an extent-mapped file
+ * as unwritten extents, in as few contiguous runs as the disk allows.
+ * The blocks read as zeros and are not written until the file is.
+ *
+ * @param inode_idx the inode number
+ * @param lblk the first file block
+ * @param end the file block after the range
+ * @return SUCCESS, or -ENOSPC if not enough free blocks
+ */
+static int fs_falloc_extents(int inode_idx, uint32_t lblk, uint32_t end)
+{
+    struct fs_inode *inode = &inodes[inode_idx];
+    struct fs_extent e;
+
+    //allocate only if there is room for every unmapped block
+    uint32_t want = 0;
+    for (uint32_t l = lblk; l < end; ) {
+        bool found = ext_next(inode, l, &e) && e.lblk < end;
+        uint32_t hole_end = found ? e.lblk : end;
+        if (hole_end > l) want += hole_end - l;
+        l = found ? e.lblk + e.len : end;
+    }
+    if (want == 0) return SUCCESS;
+    if (want + want / PTRS_PER_BLK + 3 > (uint32_t) num_free_blk()) return -ENOSPC;
+
+    //unwritten extents cannot be read by older code
+    super_set_feature(FS_FEATURE_UNWRITTEN);
+    inode->flags |= FS_INODE_UNWRITTEN;
+
+    while (lblk < end) {
+        bool found = ext_next(inode, lblk, &e) && e.lblk < end;
+        uint32_t hole_end = found ? e.lblk : end;
+        while (lblk < hole_end) {
+            //new blocks go after the block before them, or near the parent
+            uint32_t prev;
+            int goal = blk_goal[inode_idx];
+            if (lblk > 0 && fs_bmap(inode_idx, lblk - 1, 1, &prev, false) == 1) goal = prev + 1;
+            int got, start = get_free_blks(goal, (int) (hole_end - lblk), &got);
+            if (start < 0) return -ENOSPC;
+            struct fs_extent ext = {lblk, start, got, 1};
+            if (ext_insert(inode, &ext) < 0) {
+                for (int i = 0; i < got; i++) return_blk(start + i);
+                return -ENOSPC;
+            }
+            for (int i = 0; i < got; i++) bitmap_set(uninit_map, start + i);
+            lblk += got;
+        }
+        if (found) lblk = e.lblk + e.len;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Allocate the blocks of a pointer-mapped file from the end of its
+ * allocated blocks through the end of a range, and zero them on disk,
+ * since pointer-mapped files have no unwritten state.
+ *
+ * @param inode_idx the inode number
+ * @param end the file block after the range
+ * @return SUCCESS, or -ENOSPC if not enough free blocks
+ */
+static int fs_falloc_ptrs(int inode_idx, int end)
+{
+    //find the end of the allocated blocks, which may be past the end of file
+    uint32_t pblks[FALLOC_MAP_BLKS];
+    int lblk = (int) ((inodes[inode_idx].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    int n;
+    while ((n = fs_bmap(inode_idx, lblk, FALLOC_MAP_BLKS, pblks, false)) > 0) lblk += n;
+    if (end <= lblk) return SUCCESS;
+
+    //allocate the rest of the range, if there is room for all of it
+    int want = end - lblk;
+    if (want + want / PTRS_PER_BLK + 3 > num_free_blk()) return -ENOSPC;
+    while (lblk < end) {
+        int nblks = end - lblk < FALLOC_MAP_BLKS ? end - lblk : FALLOC_MAP_BLKS;
+        n = fs_bmap(inode_idx, lblk, nblks, pblks, true);
+        struct io_batch b = {0};
+        fs_queue_runs(&b, BLKDEV_WRITE, pblks, n, falloc_zeros, (size_t) n * BLOCK_SIZE, 0);
+        batch_flush(&b);
+        lblk += n;
+        if (n < nblks) return -ENOSPC;
+    }
+    return SUCCESS;
+}
+
+/**
+ * fallocate - preallocate blocks for a file, or punch a hole in it.
+ *
+ * In an extent-mapped file, the unmapped blocks in the range are
+ * allocated as unwritten extents, which read as zeros until written;
+ * a pointer-mapped file is allocated through the end of the range
+ * and zeroed. The file size grows to the end of the range unless
+ * FALLOC_FL_KEEP_SIZE is given; blocks past the end are used by
+ * later writes that extend the file. Punching a hole frees the
+ * whole blocks in the range of an extent-mapped file and zeros the
+ * rest; a pointer-mapped file has no holes and is only zeroed.
+ *
+ * Errors
+ *   -ENOENT     - file does not exist
+ *   -ENOTDIR    - component of path not a directory
+ *   -EISDIR     - path is a directory
+ *   -EINVAL     - offset or length invalid
+ *   -EOPNOTSUPP - mode not supported
+ *   -EFBIG      - range past the largest file size
+ *   -ENOSPC     - not enough free blocks
+ *
+ * @param path the file path
+ * @param mode 0, or FALLOC_FL_KEEP_SIZE optionally with FALLOC_FL_PUNCH_HOLE
+ * @param offset the start of the range
+ * @param len the length of the range
+ * @param fi fuse file info
+ * @return 0 if successful, or error value
+ */
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                        struct fuse_file_info *fi)
+{
+    struct fs_file *f = fs_file_get(fi);
+    int inode_idx = f != NULL ? f->inum : translate_path(path);
+    if (inode_idx < 0) return inode_idx;
+    struct fs_inode *inode = &inodes[inode_idx];
+    if (S_ISDIR(inode->mode)) return -EISDIR;
+    if (offset < 0 || len <= 0) return -EINVAL;
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EOPNOTSUPP;
+    if (offset > (off_t) EXT_MAX_BLKS * BLOCK_SIZE || len > (off_t) EXT_MAX_BLKS * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+    off_t end = offset + len;
+    off_t end_blk = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    bool extents = inode->flags & FS_INODE_EXTENTS;
+
+    //blocks buffered for delayed allocation are allocated first, and
+    //open files must not keep mappings of blocks that are freed
+    struct fs_delalloc *d = &delalloc[inode_idx % DELALLOC_INODES];
+    if (d->inum == inode_idx && delalloc_flush(d) < 0) return -ENOSPC;
+    fs_file_invalidate(inode_idx);
+
+    int result = SUCCESS;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && extents) {
+        off_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        off_t last = end / BLOCK_SIZE < EXT_MAX_BLKS ? end / BLOCK_SIZE : EXT_MAX_BLKS;
+        if (first < last) {
+            fs_zero_range(inode_idx, offset, first * BLOCK_SIZE < inode->size ? first * BLOCK_SIZE : inode->size);
+            fs_zero_range(inode_idx, last * BLOCK_SIZE, end < inode->size ? end : inode->size);
+            result = ext_remove(inode, (uint32_t) first, (uint32_t) (last - first), true);
+        } else {
+            fs_zero_range(inode_idx, offset, end < inode->size ? end : inode->size);
+        }
+    } else if (mode & FALLOC_FL_PUNCH_HOLE) {
+        fs_zero_range(inode_idx, offset, end < inode->size ? end : inode->size);
+    } else if (end_blk > EXT_MAX_BLKS) {
+        return -EFBIG;
+    } else {
+        result = extents ? fs_falloc_extents(inode_idx, (uint32_t) (offset / BLOCK_SIZE), (uint32_t) end_blk)
+                         : fs_falloc_ptrs(inode_idx, (int) end_blk);
+        resv_drop(inode_idx);
+        if (!(mode & FALLOC_FL_KEEP_SIZE) && result == SUCCESS && end > inode->size) {
+            inode->size = end;
+        }
+    }
+    update_inode(inode_idx);
+    flush_metadata_timed();
+    return result;
+}
+#endif
+
+/**
+ * Define a handler that runs another while holding fs_lock.
+ *
+ * @param name the handler
+ * @param params the parameter list
+ * @param args the arguments to pass
+ */
+#define FS_LOCKED(name, params, args)   \
+    static int name##_locked params     \
+    {                                   \
+        pthread_mutex_lock(&fs_lock);   \
+        int result = name args;         \
+        pthread_mutex_unlock(&fs_lock); \
+        return result;                  \
+    }
+
+FS_LOCKED(fs_getattr, (const char *path, struct stat *sb), (path, sb))
+FS_LOCKED(fs_opendir, (const char *path, struct fuse_file_info *fi), (path, fi))
+FS_LOCKED(fs_readdir, (const char *path, void *ptr, fuse_fill_dir_t filler, off_t offset,
+                       struct fuse_file_info *fi), (path, ptr, filler, offset, fi))
+FS_LOCKED(fs_releasedir, (const char *path, struct fuse_file_info *fi), (path, fi))
+FS_LOCKED(fs_mknod, (const char *path, mode_t mode, dev_t dev), (path, mode, dev))
+FS_LOCKED(fs_mkdir, (const char *path, mode_t mode), (path, mode))
+FS_LOCKED(fs_unlink, (const char *path), (path))
+FS_LOCKED(fs_rmdir, (const char *path), (path))
+FS_LOCKED(fs_rename, (const char *src_path, const char *dst_path), (src_path, dst_path))
+FS_LOCKED(fs_chmod, (const char *path, mode_t mode), (path, mode))
+FS_LOCKED(fs_utime, (const char *path, struct utimbuf *ut), (path, ut))
+FS_LOCKED(fs_truncate, (const char *path, off_t len), (path, len))
+FS_LOCKED(fs_open, (const char *path, struct fuse_file_info *fi), (path, fi))
+FS_LOCKED(fs_read, (const char *path, char *buf, size_t len, off_t offset,
+                    struct fuse_file_info *fi), (path, buf, len, offset, fi))
+FS_LOCKED(fs_write, (const char *path, const char *buf, size_t len, off_t offset,
+                     struct fuse_file_info *fi), (path, buf, len, offset, fi))
+FS_LOCKED(fs_release, (const char *path, struct fuse_file_info *fi), (path, fi))
+FS_LOCKED(fs_statfs, (const char *path, struct statvfs *st), (path, st))
+#if FUSE_VERSION >= 29
+FS_LOCKED(fs_fallocate, (const char *path, int mode, off_t offset, off_t len,
+                         struct fuse_file_info *fi), (path, mode, offset, len, fi))
+#endif
+
 /**
  * Operations vector. Please don't rename it, as the
  * skeleton code in misc.c assumes it is named 'fs_ops'.
  */
 struct fuse_operations fs_ops = {
     .init = fs_init,
-    .getattr = fs_getattr,
-    .opendir = fs_opendir,
-    .readdir = fs_readdir,
-    .releasedir = fs_releasedir,
-    .mknod = fs_mknod,
-    .mkdir = fs_mkdir,
-    .unlink = fs_unlink,
-    .rmdir = fs_rmdir,
-    .rename = fs_rename,
-    .chmod = fs_chmod,
-    .utime = fs_utime,
-    .truncate = fs_truncate,
-    .open = fs_open,
-    .read = fs_read,
-    .write = fs_write,
-    .release = fs_release,
-    .statfs = fs_statfs,
+    .destroy = fs_destroy,
+    .getattr = fs_getattr_locked,
+    .opendir = fs_opendir_locked,
+    .readdir = fs_readdir_locked,
+    .releasedir = fs_releasedir_locked,
+    .mknod = fs_mknod_locked,
+    .mkdir = fs_mkdir_locked,
+    .unlink = fs_unlink_locked,
+    .rmdir = fs_rmdir_locked,
+    .rename = fs_rename_locked,
+    .chmod = fs_chmod_locked,
+    .utime = fs_utime_locked,
+    .truncate = fs_truncate_locked,
+    .open = fs_open_locked,
+    .read = fs_read_locked,
+    .write = fs_write_locked,
+    .release = fs_release_locked,
+    .fsync = fs_fsync,
+    .fsyncdir = fs_fsyncdir,
+    .statfs = fs_statfs_locked,
+#if FUSE_VERSION >= 29
+    .fallocate = fs_fallocate_locked,
+#endif
 };
 
 
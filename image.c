@@ -18,17 +18,58 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "blkdev.h"
+#include "image.h"
+
+#ifdef __linux__
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE	// <linux/fs.h> macro shadows blkdev.h constant
+
+// hidden by _XOPEN_SOURCE in "unistd.h" and "fcntl.h"
+extern long syscall(long number, ...);
+#endif
 
 // should be defined in "string.h" but is not on macos
 extern char* strdup(const char *);
 
+// hidden by _XOPEN_SOURCE in "sys/uio.h"
+extern ssize_t preadv(int, const struct iovec *, int, off_t);
+extern ssize_t pwritev(int, const struct iovec *, int, off_t);
+
+#ifdef __linux__
+/** submission and completion rings of an io_uring instance */
+struct image_uring {
+    int ring_fd;				// io_uring file descriptor
+    unsigned *sq_head;			// submission queue head (kernel)
+    unsigned *sq_tail;			// submission queue tail (us)
+    unsigned *sq_mask;			// submission queue index mask
+    unsigned *sq_entries;		// submission queue size
+    unsigned *sq_array;			// submission queue index array
+    struct io_uring_sqe *sqes;	// submission queue entries
+    unsigned *cq_head;			// completion queue head (us)
+    unsigned *cq_tail;			// completion queue tail (kernel)
+    unsigned *cq_mask;			// completion queue index mask
+    unsigned *cq_entries;		// completion queue size
+    struct io_uring_cqe *cqes;	// completion queue entries
+    void  *sq_ptr, *cq_ptr;		// mapped rings
+    size_t sq_sz, cq_sz, sqes_sz;	// mapped ring sizes
+    unsigned inflight;			// requests submitted but not reaped
+    pthread_mutex_t lock;		// protects the rings
+};
+#endif
+
 /** definition of image block device */
 struct image_dev {
     char *path;		// path to device file
     int   fd;		// file descriptor of open file
     int   nblks;	// number of blocks in device
+    char *map;		// mapped image, or NULL if not mapped
+    struct image_uring *ring;	// io_uring, or NULL if not used
 };
 
 
@@ -95,9 +136,6 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
-    if (offset == 0)
-        printf("ERROR? write to sector 0\n");
-    
     /* to fail a disk we close its file descriptor and set it to -1 */
     if (im->fd == -1)
         return E_UNAVAIL;
@@ -117,15 +155,104 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
 }
 
 /**
- * Flush the block device.
+ * Total number of blocks in scattered buffers.
+ *
+ * @param iov the buffers
+ * @param iovcnt the number of buffers
+ * @return the number of blocks
+ */
+static int iov_blocks(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len / BLOCK_SIZE;
+}
+
+/**
+ * Read consecutive blocks into scattered buffers with one call.
+ *
+ * @param dev the block device
+ * @param offset starting block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt number of buffers
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_readv(struct blkdev *dev, int offset, const struct iovec *iov, int iovcnt)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1) {
+        return E_UNAVAIL;
+    }
+    int len = iov_blocks(iov, iovcnt);
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    ssize_t result = preadv(im->fd, iov, iovcnt, (off_t)offset*BLOCK_SIZE);
+
+    /* as in image_read, report errors and then exit */
+    if (result != (ssize_t)len*BLOCK_SIZE) {
+        fprintf(stderr, "read error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Write consecutive blocks from scattered buffers with one call.
+ *
+ * @param dev the block device
+ * @param offset starting block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt number of buffers
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_writev(struct blkdev *dev, int offset, const struct iovec *iov, int iovcnt)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    int len = iov_blocks(iov, iovcnt);
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    ssize_t result = pwritev(im->fd, iov, iovcnt, (off_t)offset*BLOCK_SIZE);
+
+    /* again, report the error and then exit with an assert
+     */
+    if (result != (ssize_t)len*BLOCK_SIZE) {
+        fprintf(stderr, "write error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Flush blocks of the block device to the image file's storage.
+ * Any range is flushed with fdatasync, which is a write barrier that
+ * also flushes the drive's cache; sync_file_range would write just
+ * the range, but makes nothing durable.
  *
  * @param dev the block device
- * @aparam offset starting byte offset
- * @param len number of bytes to flush
+ * @param offset starting block number
+ * @param len number of blocks to flush
  * @return SUCCESS if successful, E_UNAVAIL if device unavailable
  */
 static int image_flush(struct blkdev * dev, int offset, int len)
 {
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1) {
+        return E_UNAVAIL;
+    }
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    if (fdatasync(im->fd) < 0) {
+        fprintf(stderr, "fdatasync error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
     return SUCCESS;
 }
 
@@ -139,6 +266,22 @@ static void image_close(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
 
+    if (im->map != NULL) {
+        munmap(im->map, (size_t)im->nblks * BLOCK_SIZE);
+    }
+#ifdef __linux__
+    if (im->ring != NULL) {
+        struct image_uring *r = im->ring;
+        munmap(r->sqes, r->sqes_sz);
+        if (r->cq_ptr != r->sq_ptr) {
+            munmap(r->cq_ptr, r->cq_sz);
+        }
+        munmap(r->sq_ptr, r->sq_sz);
+        close(r->ring_fd);
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+    }
+#endif
     if (im->fd != -1) {
         close(im->fd);
     }
@@ -153,9 +296,376 @@ static struct blkdev_ops image_ops = {
     .read = image_read,
     .write = image_write,
     .flush = image_flush,
-    .close = image_close
+    .close = image_close,
+    .readv = image_readv,
+    .writev = image_writev
 };
 
+/**
+ * Read blocks from mapped image device starting at given block.
+ *
+ * @param dev the block device
+ * @param offset starting block number
+ * @param len number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_read(struct blkdev *dev, int offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1) {
+        return E_UNAVAIL;
+    }
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    memcpy(buf, im->map + (size_t)offset*BLOCK_SIZE, (size_t)len*BLOCK_SIZE);
+    return SUCCESS;
+}
+
+/**
+ * Write blocks to mapped image device starting at given block.
+ *
+ * @param dev the block device
+ * @param offset starting block number
+ * @param len number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_write(struct blkdev *dev, int offset, int len, void *buf)
+{
+    struct image_dev *im = dev->private;
+
+    /* to fail a disk we close its file descriptor and set it to -1 */
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    memcpy(im->map + (size_t)offset*BLOCK_SIZE, buf, (size_t)len*BLOCK_SIZE);
+    return SUCCESS;
+}
+
+/**
+ * Read consecutive blocks of mapped image device into
+ * scattered buffers.
+ *
+ * @param dev the block device
+ * @param offset starting block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt number of buffers
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_readv(struct blkdev *dev, int offset, const struct iovec *iov, int iovcnt)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1) {
+        return E_UNAVAIL;
+    }
+    assert(offset >= 0 && offset+iov_blocks(iov, iovcnt) <= im->nblks);
+
+    char *p = im->map + (size_t)offset*BLOCK_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(iov[i].iov_base, p, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Write consecutive blocks of mapped image device from
+ * scattered buffers.
+ *
+ * @param dev the block device
+ * @param offset starting block number
+ * @param iov the buffers, each a multiple of the block size
+ * @param iovcnt number of buffers
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_writev(struct blkdev *dev, int offset, const struct iovec *iov, int iovcnt)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+iov_blocks(iov, iovcnt) <= im->nblks);
+
+    char *p = im->map + (size_t)offset*BLOCK_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Flush blocks of mapped image device to the image file.
+ * Only the pages spanning the requested blocks are synced.
+ *
+ * @param dev the block device
+ * @param offset starting block number
+ * @param len number of blocks to flush
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int image_mmap_flush(struct blkdev *dev, int offset, int len)
+{
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    assert(offset >= 0 && offset+len <= im->nblks);
+
+    /* msync requires a page-aligned start address */
+    size_t pagesz = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)offset*BLOCK_SIZE;
+    size_t end = start + (size_t)len*BLOCK_SIZE;
+    start -= start % pagesz;
+
+    if (msync(im->map + start, end - start, MS_SYNC) < 0) {
+        fprintf(stderr, "msync error on %s: %s\n", im->path, strerror(errno));
+        assert(0);
+    }
+    return SUCCESS;
+}
+
+/** Operations on mapped image block device */
+static struct blkdev_ops image_mmap_ops = {
+    .num_blocks = image_num_blocks,
+    .read = image_mmap_read,
+    .write = image_mmap_write,
+    .flush = image_mmap_flush,
+    .close = image_close,
+    .readv = image_mmap_readv,
+    .writev = image_mmap_writev
+};
+
+#ifdef __linux__
+/**
+ * Move completed requests from the completion queue to their
+ * blkdev_req structures. Must be called with the ring locked.
+ *
+ * @param im the image device
+ */
+static void image_uring_reap(struct image_dev *im)
+{
+    struct image_uring *r = im->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    for ( ; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct blkdev_req *req = (struct blkdev_req *)(uintptr_t)cqe->user_data;
+
+        /* as for image_read and image_write, report the error and exit */
+        if (cqe->res != req->num_blks*BLOCK_SIZE) {
+            fprintf(stderr, "%s error on %s: %s\n",
+                    req->op == BLKDEV_READ ? "read" : "write", im->path,
+                    cqe->res < 0 ? strerror(-cqe->res) : "short transfer");
+            assert(0);
+        }
+        req->status = SUCCESS;
+        req->done = 1;
+        r->inflight--;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Enter the kernel to submit queued entries and optionally
+ * wait for completions.
+ *
+ * @param r the ring
+ * @param to_submit number of entries to submit
+ * @param min_complete number of completions to wait for
+ */
+static void image_uring_enter(struct image_uring *r, unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (syscall(__NR_io_uring_enter, r->ring_fd, to_submit, min_complete,
+                   flags, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "io_uring_enter error: %s\n", strerror(errno));
+            assert(0);
+        }
+    }
+}
+
+/**
+ * Submit read and write requests to the ring with a single
+ * system call. Requests complete asynchronously in any order.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if submitted, E_UNAVAIL if device unavailable
+ */
+static int image_uring_submit(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct image_dev *im = dev->private;
+    struct image_uring *r = im->ring;
+
+    if (im->fd == -1) {
+        return E_UNAVAIL;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    unsigned tail = *r->sq_tail;
+    unsigned queued = 0;
+    for (int i = 0; i < nreqs; i++) {
+        struct blkdev_req *req = &reqs[i];
+        assert(req->first_blk >= 0 && req->first_blk+req->num_blks <= im->nblks);
+
+        /* make room: completion queue must not overflow */
+        if (queued == *r->sq_entries || r->inflight + queued >= *r->cq_entries) {
+            __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+            image_uring_enter(r, queued, r->inflight + queued >= *r->cq_entries ? 1 : 0);
+            r->inflight += queued;
+            queued = 0;
+            image_uring_reap(im);
+        }
+
+        unsigned idx = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        if (req->iov != NULL) {
+            sqe->opcode = req->op == BLKDEV_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->addr = (uintptr_t)req->iov;
+            sqe->len = req->iovcnt;
+        } else {
+            sqe->opcode = req->op == BLKDEV_READ ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->addr = (uintptr_t)req->buf;
+            sqe->len = req->num_blks*BLOCK_SIZE;
+        }
+        sqe->fd = im->fd;
+        sqe->off = (off_t)req->first_blk*BLOCK_SIZE;
+        sqe->user_data = (uintptr_t)req;
+        r->sq_array[idx] = idx;
+        req->done = 0;
+        tail++;
+        queued++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    if (queued > 0) {
+        image_uring_enter(r, queued, 0);
+        r->inflight += queued;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return SUCCESS;
+}
+
+/**
+ * Wait for submitted requests to complete.
+ *
+ * @param dev the block device
+ * @param reqs the requests
+ * @param nreqs the number of requests
+ * @return SUCCESS if all requests succeeded, or first error status
+ */
+static int image_uring_complete(struct blkdev *dev, struct blkdev_req *reqs, int nreqs)
+{
+    struct image_dev *im = dev->private;
+    struct image_uring *r = im->ring;
+
+    pthread_mutex_lock(&r->lock);
+    for (int i = 0; i < nreqs; i++) {
+        while (!reqs[i].done) {
+            image_uring_reap(im);
+            if (!reqs[i].done) {
+                image_uring_enter(r, 0, 1);
+            }
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    for (int i = 0; i < nreqs; i++) {
+        if (reqs[i].status < 0) {
+            return reqs[i].status;
+        }
+    }
+    return SUCCESS;
+}
+
+/** Operations on io_uring image block device */
+static struct blkdev_ops image_uring_ops = {
+    .num_blocks = image_num_blocks,
+    .read = image_read,
+    .write = image_write,
+    .flush = image_flush,
+    .close = image_close,
+    .readv = image_readv,
+    .writev = image_writev,
+    .submit = image_uring_submit,
+    .complete = image_uring_complete
+};
+
+/**
+ * Set up an io_uring instance and map its rings.
+ *
+ * @param entries the submission queue size
+ * @return the ring or NULL if io_uring is not available
+ */
+static struct image_uring *image_uring_setup(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct image_uring *r = calloc(1, sizeof(*r));
+    r->ring_fd = fd;
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz) {
+            r->sq_sz = r->cq_sz;
+        }
+        r->cq_sz = r->sq_sz;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        close(fd);
+        free(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, IORING_OFF_SQES);
+    if (r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+        munmap(r->sq_ptr, r->sq_sz);
+        close(fd);
+        free(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cq_entries = (unsigned *)(cq + p.cq_off.ring_entries);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    pthread_mutex_init(&r->lock, NULL);
+    return r;
+}
+#endif
+
 /**
  * Create an image block device reading from a specified image file.
  *
@@ -195,12 +705,75 @@ struct blkdev *image_create(char *path)
                 path, BLOCK_SIZE);
     }
     im->nblks = sb.st_size / BLOCK_SIZE;
+    im->map = NULL;
+    im->ring = NULL;
     dev->private = im;
     dev->ops = &image_ops;
 
     return dev;
 }
 
+/**
+ * Create an image block device that maps the entire image
+ * file into memory, reading and writing blocks by copying
+ * to and from the shared mapping.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open or map image file
+ */
+struct blkdev *image_mmap_create(char *path)
+{
+    struct blkdev *dev = image_create(path);
+    if (dev == NULL) {
+        return NULL;
+    }
+
+    struct image_dev *im = dev->private;
+    im->map = mmap(NULL, (size_t)im->nblks * BLOCK_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, im->fd, 0);
+    if (im->map == MAP_FAILED) {
+        fprintf(stderr, "can't map image %s: %s\n", path, strerror(errno));
+        im->map = NULL;
+        image_close(dev);
+        return NULL;
+    }
+    dev->ops = &image_mmap_ops;
+
+    return dev;
+}
+
+/**
+ * Create an image block device that performs batched requests
+ * asynchronously through io_uring. Single reads and writes
+ * still use pread and pwrite.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open image file
+ *   or io_uring is not available
+ */
+struct blkdev *image_uring_create(char *path)
+{
+#ifdef __linux__
+    struct blkdev *dev = image_create(path);
+    if (dev == NULL) {
+        return NULL;
+    }
+
+    struct image_dev *im = dev->private;
+    if ((im->ring = image_uring_setup(IMAGE_URING_ENTRIES)) == NULL) {
+        fprintf(stderr, "can't set up io_uring for %s: %s\n", path, strerror(errno));
+        image_close(dev);
+        return NULL;
+    }
+    dev->ops = &image_uring_ops;
+
+    return dev;
+#else
+    fprintf(stderr, "can't use io_uring for %s: not supported\n", path);
+    return NULL;
+#endif
+}
+
 /**
  * Force an image blkdev into failure. After this any
  * further access to that device will return E_UNAVAIL.
@@ -209,6 +782,10 @@ void image_fail(struct blkdev *dev)
 {
     struct image_dev *im = dev->private;
 
+    if (im->map != NULL) {
+        munmap(im->map, (size_t)im->nblks * BLOCK_SIZE);
+        im->map = NULL;
+    }
     if (im->fd != -1) {
         close(im->fd);
     }
@@ -11,6 +11,9 @@
 
 #include "blkdev.h"
 
+/** io_uring submission queue size */
+enum {IMAGE_URING_ENTRIES = 64};
+
 /**
  * Create an image block device reading from a specified image file.
  *
@@ -19,5 +22,26 @@
  */
 extern struct blkdev *image_create(char *path);
 
+/**
+ * Create an image block device that maps the entire image
+ * file into memory, reading and writing blocks by copying
+ * to and from the shared mapping.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open or map image file
+ */
+extern struct blkdev *image_mmap_create(char *path);
+
+/**
+ * Create an image block device that performs batched requests
+ * asynchronously through io_uring. Single reads and writes
+ * still use pread and pwrite.
+ *
+ * @param path the path to the image file
+ * @return the block device or NULL if cannot open image file
+ *   or io_uring is not available
+ */
+extern struct blkdev *image_uring_create(char *path);
+
 
 #endif /* IMAGE_H_ */
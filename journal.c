@@ -0,0 +1,660 @@
+/*
+ * file:        journal.c
+ * description: Write-ahead journal for file system metadata blocks
+ *
+ * Metadata blocks are logged in memory as part of the running
+ * transaction instead of being written in place. A commit appends the
+ * transaction to the circular log on disk with sequential writes and
+ * flushes the device. The logged copies stay in memory, where they
+ * are read in place of their out-of-date home locations, until a
+ * checkpoint writes them home and empties the log.
+ *
+ * A checkpoint is only done between transactions, so only committed
+ * copies are written home. One is done after any commit that leaves
+ * less than room for two transactions, so the next transaction always
+ * fits, even if it has to wrap to the start of the log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fsx600.h"
+#include "journal.h"
+
+/** most log blocks per transaction, which bounds the iovec count */
+enum {JOURNAL_MAX_TXN = 512};
+
+/** a logged block */
+struct journal_buf {
+    int blkno;                      // home block number, or -1 if unused
+    bool in_txn;                    // logged in the running transaction
+    struct journal_buf *hnext;      // next buffer in hash chain or free list
+    char data[FS_BLOCK_SIZE];       // latest block contents
+};
+
+/** definition of journal */
+struct journal {
+    struct blkdev *dev;             // block device
+    int start;                      // first block of journal region
+    int nblks;                      // journal size in blocks
+    uint32_t head_seq;              // sequence number of first logged transaction
+    uint32_t seq;                   // sequence number of running transaction
+    int head;                       // log block of first logged transaction
+    int tail;                       // log block for next record
+    int used;                       // log blocks used, including skipped at wrap
+    int txn_max;                    // most log blocks per transaction
+    int rec_max;                    // most entries per descriptor
+    int nbufs;                      // number of buffers
+    struct journal_buf *bufs;       // buffer storage
+    struct journal_buf *free_bufs;  // list of unused buffers
+    struct journal_buf **hash;      // hash table of buffer chains
+    int hash_mask;                  // hash table size - 1
+    struct journal_buf **list;      // buffers being written home
+    struct journal_buf **txn;       // buffers logged in running transaction
+    int ntxn;                       // number of buffers in running transaction
+    uint32_t *revokes;              // blocks revoked in running transaction
+    int nrevokes;                   // number of revoked blocks
+    struct fs_journal_desc *descs;  // descriptors of transaction being committed
+    struct iovec *iov;              // buffers of transaction being committed
+    pthread_mutex_t lock;           // protects all of the above
+};
+
+/**
+ * Continue an FNV-1a hash over a buffer.
+ *
+ * @param h the hash so far
+ * @param p the buffer
+ * @param len the buffer length
+ * @return the new hash
+ */
+static uint32_t journal_hash(uint32_t h, const void *p, size_t len)
+{
+    const unsigned char *s = p;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ s[i]) * 16777619u;
+    }
+    return h;
+}
+
+/** initial value for journal_hash */
+static const uint32_t JOURNAL_HASH_INIT = 2166136261u;
+
+/**
+ * Get hash chain for a block number.
+ *
+ * @param j the journal
+ * @param blkno the block number
+ * @return pointer to the head of the hash chain
+ */
+static struct journal_buf **journal_chain(struct journal *j, int blkno)
+{
+    return &j->hash[blkno & j->hash_mask];
+}
+
+/**
+ * Find the logged copy of a block.
+ *
+ * @param j the journal
+ * @param blkno the block number
+ * @return the buffer or NULL if block is not logged
+ */
+static struct journal_buf *journal_find(struct journal *j, int blkno)
+{
+    for (struct journal_buf *b = *journal_chain(j, blkno); b != NULL; b = b->hnext) {
+        if (b->blkno == blkno) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Return a buffer to the free list, removing it from its hash chain.
+ *
+ * @param j the journal
+ * @param b the buffer
+ */
+static void journal_release(struct journal *j, struct journal_buf *b)
+{
+    for (struct journal_buf **pp = journal_chain(j, b->blkno); *pp != NULL; pp = &(*pp)->hnext) {
+        if (*pp == b) {
+            *pp = b->hnext;
+            break;
+        }
+    }
+    b->blkno = -1;
+    b->in_txn = false;
+    b->hnext = j->free_bufs;
+    j->free_bufs = b;
+}
+
+/**
+ * Number of log blocks for a transaction.
+ *
+ * @param j the journal
+ * @param ndata number of logged blocks
+ * @param nrevokes number of revoked blocks
+ * @return log blocks for descriptors and logged blocks
+ */
+static int journal_txn_blks(struct journal *j, int ndata, int nrevokes)
+{
+    return ndata + (ndata + nrevokes + j->rec_max - 1) / j->rec_max;
+}
+
+/**
+ * Write the journal superblock and flush the device.
+ *
+ * @param j the journal
+ * @return SUCCESS if successful, or device error
+ */
+static int journal_write_super(struct journal *j)
+{
+    struct fs_journal_super js;
+    memset(&js, 0, sizeof(js));
+    js.magic = FS_JOURNAL_MAGIC;
+    js.seq = j->head_seq;
+    js.head = j->head;
+    int result = j->dev->ops->write(j->dev, j->start, 1, &js);
+    if (result < 0) {
+        return result;
+    }
+    return j->dev->ops->flush(j->dev, 0, j->dev->ops->num_blocks(j->dev));
+}
+
+/**
+ * Compare buffers by block number for qsort.
+ *
+ * @param a pointer to first buffer pointer
+ * @param b pointer to second buffer pointer
+ * @return negative, zero, or positive as a is before, at, or after b
+ */
+static int journal_buf_cmp(const void *a, const void *b)
+{
+    int x = (*(struct journal_buf * const *) a)->blkno;
+    int y = (*(struct journal_buf * const *) b)->blkno;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Write every logged block home in runs of consecutive blocks,
+ * then empty the log. There must be no running transaction.
+ *
+ * @param j the journal
+ * @return SUCCESS if successful, or device error
+ */
+static int journal_checkpoint_locked(struct journal *j)
+{
+    int n = 0;
+    for (int i = 0; i < j->nbufs; i++) {
+        if (j->bufs[i].blkno >= 0) {
+            j->list[n++] = &j->bufs[i];
+        }
+    }
+    if (n == 0 && j->used == 0) {
+        return SUCCESS;
+    }
+    qsort(j->list, n, sizeof(*j->list), journal_buf_cmp);
+
+    for (int i = 0; i < n; ) {
+        int len = 0;
+        do {
+            j->iov[len].iov_base = j->list[i + len]->data;
+            j->iov[len].iov_len = FS_BLOCK_SIZE;
+            len++;
+        } while (i + len < n && len < j->txn_max
+                 && j->list[i + len]->blkno == j->list[i]->blkno + len);
+        int result = blkdev_writev(j->dev, j->list[i]->blkno, j->iov, len);
+        if (result < 0) {
+            return result;
+        }
+        i += len;
+    }
+
+    /* home locations must be stable before the log is emptied */
+    int result = j->dev->ops->flush(j->dev, 0, j->dev->ops->num_blocks(j->dev));
+    if (result < 0) {
+        return result;
+    }
+    for (int i = 0; i < n; i++) {
+        journal_release(j, j->list[i]);
+    }
+    j->head = j->tail;
+    j->head_seq = j->seq;
+    j->used = 0;
+    return journal_write_super(j);
+}
+
+/**
+ * Write buffers to consecutive log blocks.
+ *
+ * @param j the journal
+ * @param pos the first log block
+ * @param niov the number of buffers
+ * @return SUCCESS if successful, or device error
+ */
+static int journal_write_log(struct journal *j, int pos, int niov)
+{
+    if (niov == 0) {
+        return SUCCESS;
+    }
+    return blkdev_writev(j->dev, j->start + pos, j->iov, niov);
+}
+
+/**
+ * Append the running transaction to the log as one record per
+ * rec_max entries, and flush the device. Logged blocks come first
+ * and revokes last, so each record's logged blocks are consecutive
+ * in the transaction.
+ *
+ * @param j the journal
+ * @return SUCCESS if successful, or device error
+ */
+static int journal_commit_locked(struct journal *j)
+{
+    int nentries = j->ntxn + j->nrevokes;
+    if (nentries == 0) {
+        return SUCCESS;
+    }
+    int nrecs = (nentries + j->rec_max - 1) / j->rec_max;
+
+    int e = 0, niov = 0, pos = j->tail, result;
+    for (int r = 0; r < nrecs; r++) {
+        struct fs_journal_desc *d = &j->descs[r];
+        memset(d, 0, sizeof(*d));
+        d->magic = FS_JOURNAL_DESC_MAGIC;
+        d->seq = j->seq;
+        d->flags = r == nrecs - 1 ? FS_JOURNAL_COMMIT : 0;
+        d->count = nentries - e < j->rec_max ? nentries - e : j->rec_max;
+
+        int first = e, ndata = 0;
+        for (int k = 0; k < (int) d->count; k++, e++) {
+            if (e < j->ntxn) {
+                d->blocks[k] = j->txn[e]->blkno;
+                ndata++;
+            } else {
+                d->blocks[k] = j->revokes[e - j->ntxn] | FS_JOURNAL_REVOKE;
+            }
+        }
+        uint32_t h = journal_hash(JOURNAL_HASH_INIT, d, FS_BLOCK_SIZE);
+        for (int k = 0; k < ndata; k++) {
+            h = journal_hash(h, j->txn[first + k]->data, FS_BLOCK_SIZE);
+        }
+        d->checksum = h;
+
+        /* a record that does not fit before the end starts the log again */
+        if (j->tail + 1 + ndata > j->nblks) {
+            if ((result = journal_write_log(j, pos, niov)) < 0) {
+                return result;
+            }
+            j->used += j->nblks - j->tail;
+            j->tail = pos = 1;
+            niov = 0;
+        }
+        j->iov[niov].iov_base = d;
+        j->iov[niov++].iov_len = FS_BLOCK_SIZE;
+        for (int k = 0; k < ndata; k++) {
+            j->iov[niov].iov_base = j->txn[first + k]->data;
+            j->iov[niov++].iov_len = FS_BLOCK_SIZE;
+        }
+        j->tail += 1 + ndata;
+        j->used += 1 + ndata;
+    }
+    if ((result = journal_write_log(j, pos, niov)) < 0) {
+        return result;
+    }
+
+    for (int i = 0; i < j->ntxn; i++) {
+        j->txn[i]->in_txn = false;
+    }
+    j->ntxn = j->nrevokes = 0;
+    j->seq++;
+
+    result = j->dev->ops->flush(j->dev, 0, j->dev->ops->num_blocks(j->dev));
+    if (result == SUCCESS && j->nblks - 1 - j->used < 2 * j->txn_max) {
+        result = journal_checkpoint_locked(j);
+    }
+    return result;
+}
+
+int journal_format(struct blkdev *dev, int start, int nblks)
+{
+    if (nblks < JOURNAL_MIN_BLKS) {
+        return E_SIZE;
+    }
+
+    /* a stale record at the head must not be taken as the first one */
+    char zeros[FS_BLOCK_SIZE];
+    memset(zeros, 0, FS_BLOCK_SIZE);
+    int result = dev->ops->write(dev, start + 1, 1, zeros);
+    if (result < 0) {
+        return result;
+    }
+
+    struct fs_journal_super js;
+    memset(&js, 0, sizeof(js));
+    js.magic = FS_JOURNAL_MAGIC;
+    js.seq = 1;
+    js.head = 1;
+    result = dev->ops->write(dev, start, 1, &js);
+    if (result < 0) {
+        return result;
+    }
+    return dev->ops->flush(dev, 0, dev->ops->num_blocks(dev));
+}
+
+struct journal *journal_open(struct blkdev *dev, int start, int nblks)
+{
+    struct fs_journal_super js;
+    if (nblks < JOURNAL_MIN_BLKS || dev->ops->read(dev, start, 1, &js) < 0
+        || js.magic != FS_JOURNAL_MAGIC || js.head < 1 || js.head > (uint32_t) nblks) {
+        return NULL;
+    }
+
+    struct journal *j = calloc(1, sizeof(*j));
+    if (j == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    j->dev = dev;
+    j->start = start;
+    j->nblks = nblks;
+    j->head_seq = j->seq = js.seq;
+    j->head = j->tail = js.head;
+    j->txn_max = (nblks - 1) / 4 < JOURNAL_MAX_TXN ? (nblks - 1) / 4 : JOURNAL_MAX_TXN;
+    j->rec_max = j->txn_max - 1 < FS_JOURNAL_DESC_ENTRIES ? j->txn_max - 1 : FS_JOURNAL_DESC_ENTRIES;
+
+    /* blocks logged since a checkpoint never outnumber the log blocks */
+    int nhash = 1;
+    while (nhash < nblks) {
+        nhash <<= 1;
+    }
+    j->nbufs = nblks;
+    j->bufs = malloc(nblks * sizeof(*j->bufs));
+    j->hash = calloc(nhash, sizeof(*j->hash));
+    j->list = malloc(nblks * sizeof(*j->list));
+    j->txn = malloc(j->txn_max * sizeof(*j->txn));
+    j->revokes = malloc(j->txn_max * sizeof(*j->revokes));
+    j->descs = malloc(j->txn_max * sizeof(*j->descs));
+    j->iov = malloc(j->txn_max * sizeof(*j->iov));
+    if (j->bufs == NULL || j->hash == NULL || j->list == NULL || j->txn == NULL
+        || j->revokes == NULL || j->descs == NULL || j->iov == NULL) {
+        fprintf(stderr, "can't allocate %d block journal\n", nblks);
+        j->nbufs = 0;
+        journal_close(j);
+        return NULL;
+    }
+    j->hash_mask = nhash - 1;
+    for (int i = nblks - 1; i >= 0; i--) {
+        j->bufs[i].blkno = -1;
+        j->bufs[i].in_txn = false;
+        j->bufs[i].hnext = j->free_bufs;
+        j->free_bufs = &j->bufs[i];
+    }
+    return j;
+}
+
+/**
+ * Read and check the record of a transaction at a log block,
+ * or at the start of the log if the record was wrapped.
+ *
+ * @param j the journal
+ * @param pos the log block, set to where the record was found
+ * @param seq the transaction sequence number
+ * @param d buffer for the descriptor
+ * @param data buffer for FS_JOURNAL_DESC_ENTRIES blocks
+ * @return number of log blocks in record, 0 if none, or device error
+ */
+static int journal_read_record(struct journal *j, int *pos, uint32_t seq,
+                               struct fs_journal_desc *d, char *data)
+{
+    for (int p = *pos; ; p = 1) {
+        if (p < j->nblks) {
+            int result = j->dev->ops->read(j->dev, j->start + p, 1, d);
+            if (result < 0) {
+                return result;
+            }
+            int ndata = 0;
+            for (uint32_t k = 0; k < d->count && k < FS_JOURNAL_DESC_ENTRIES; k++) {
+                ndata += (d->blocks[k] & FS_JOURNAL_REVOKE) == 0;
+            }
+            if (d->magic == FS_JOURNAL_DESC_MAGIC && d->seq == seq
+                && d->count <= FS_JOURNAL_DESC_ENTRIES && p + 1 + ndata <= j->nblks) {
+                if (ndata > 0 && (result = j->dev->ops->read(j->dev, j->start + p + 1, ndata, data)) < 0) {
+                    return result;
+                }
+                uint32_t checksum = d->checksum;
+                d->checksum = 0;
+                uint32_t h = journal_hash(JOURNAL_HASH_INIT, d, FS_BLOCK_SIZE);
+                if (journal_hash(h, data, (size_t) ndata * FS_BLOCK_SIZE) == checksum) {
+                    *pos = p;
+                    return 1 + ndata;
+                }
+            }
+        }
+        if (p == 1) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Check if a block is revoked by a transaction after a given one.
+ *
+ * @param revokes revoked blocks
+ * @param seqs sequence numbers of the revoking transactions
+ * @param n number of revoked blocks
+ * @param blkno the block number
+ * @param seq the transaction sequence number
+ * @return true if revoked after transaction seq
+ */
+static bool journal_revoked(const uint32_t *revokes, const uint32_t *seqs, int n,
+                            uint32_t blkno, uint32_t seq)
+{
+    for (int i = 0; i < n; i++) {
+        if (revokes[i] == blkno && (int32_t) (seqs[i] - seq) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int journal_replay(struct journal *j)
+{
+    struct fs_journal_desc d;
+    char *data = malloc((size_t) FS_JOURNAL_DESC_ENTRIES * FS_BLOCK_SIZE);
+    uint32_t *revokes = malloc(j->nblks * FS_JOURNAL_DESC_ENTRIES * sizeof(uint32_t));
+    uint32_t *seqs = malloc(j->nblks * FS_JOURNAL_DESC_ENTRIES * sizeof(uint32_t));
+    if (data == NULL || revokes == NULL || seqs == NULL) {
+        free(data);
+        free(revokes);
+        free(seqs);
+        return E_SIZE;
+    }
+
+    /* find the complete transactions and the blocks they revoke */
+    int pos = j->head, end = j->head, ntxns = 0, nrevokes = 0, committed = 0, n;
+    uint32_t seq = j->head_seq;
+    while ((n = journal_read_record(j, &pos, seq, &d, data)) > 0) {
+        for (uint32_t k = 0; k < d.count; k++) {
+            if (d.blocks[k] & FS_JOURNAL_REVOKE) {
+                revokes[nrevokes] = d.blocks[k] & ~FS_JOURNAL_REVOKE;
+                seqs[nrevokes++] = seq;
+            }
+        }
+        pos += n;
+        if (d.flags & FS_JOURNAL_COMMIT) {
+            end = pos;
+            committed = nrevokes;
+            ntxns++;
+            seq++;
+        }
+    }
+
+    /* write their blocks home, in order */
+    int result = n;
+    pos = j->head;
+    for (int t = 0; t < ntxns && result >= 0; ) {
+        uint32_t tseq = j->head_seq + t;
+        if ((result = n = journal_read_record(j, &pos, tseq, &d, data)) <= 0) {
+            result = result < 0 ? result : E_BADADDR;
+            break;
+        }
+        char *p = data;
+        for (uint32_t k = 0; k < d.count && result >= 0; k++) {
+            if (d.blocks[k] & FS_JOURNAL_REVOKE) {
+                continue;
+            }
+            if (!journal_revoked(revokes, seqs, committed, d.blocks[k], tseq)) {
+                result = j->dev->ops->write(j->dev, d.blocks[k], 1, p);
+            }
+            p += FS_BLOCK_SIZE;
+        }
+        pos += n;
+        if (d.flags & FS_JOURNAL_COMMIT) {
+            t++;
+        }
+    }
+    free(data);
+    free(revokes);
+    free(seqs);
+    if (result < 0) {
+        return result;
+    }
+
+    /* start after a partly written transaction, so its records are never reused */
+    result = j->dev->ops->flush(j->dev, 0, j->dev->ops->num_blocks(j->dev));
+    if (result < 0) {
+        return result;
+    }
+    j->head = j->tail = end < j->nblks ? end : 1;
+    j->head_seq = j->seq = seq + 1;
+    j->used = 0;
+    result = journal_write_super(j);
+    return result < 0 ? result : ntxns;
+}
+
+bool journal_read(struct journal *j, int blkno, void *buf)
+{
+    pthread_mutex_lock(&j->lock);
+    struct journal_buf *b = journal_find(j, blkno);
+    if (b != NULL) {
+        memcpy(buf, b->data, FS_BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return b != NULL;
+}
+
+int journal_log(struct journal *j, int blkno, const void *data)
+{
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&j->lock);
+    struct journal_buf *b = journal_find(j, blkno);
+    if ((b == NULL || !b->in_txn)
+        && journal_txn_blks(j, j->ntxn + 1, j->nrevokes) > j->txn_max) {
+        result = journal_commit_locked(j);
+        b = journal_find(j, blkno);     // a checkpoint frees the buffer
+    }
+    if (result == SUCCESS && b == NULL) {
+        if (j->free_bufs == NULL && (result = journal_commit_locked(j)) == SUCCESS) {
+            result = journal_checkpoint_locked(j);
+        }
+        if (result == SUCCESS) {
+            b = j->free_bufs;
+            j->free_bufs = b->hnext;
+            b->blkno = blkno;
+            struct journal_buf **chain = journal_chain(j, blkno);
+            b->hnext = *chain;
+            *chain = b;
+        }
+    }
+    if (result == SUCCESS) {
+        memcpy(b->data, data, FS_BLOCK_SIZE);
+        if (!b->in_txn) {
+            b->in_txn = true;
+            j->txn[j->ntxn++] = b;
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return result;
+}
+
+int journal_revoke(struct journal *j, int blkno)
+{
+    int result = SUCCESS;
+
+    pthread_mutex_lock(&j->lock);
+    struct journal_buf *b = journal_find(j, blkno);
+    if (b != NULL) {
+        if (b->in_txn) {
+            for (int i = 0; i < j->ntxn; i++) {
+                if (j->txn[i] == b) {
+                    j->txn[i] = j->txn[--j->ntxn];
+                    break;
+                }
+            }
+        }
+        journal_release(j, b);
+        if (j->nrevokes == j->txn_max
+            || journal_txn_blks(j, j->ntxn, j->nrevokes + 1) > j->txn_max) {
+            result = journal_commit_locked(j);
+        }
+        if (result == SUCCESS) {
+            j->revokes[j->nrevokes++] = blkno;
+        }
+    }
+    pthread_mutex_unlock(&j->lock);
+    return result;
+}
+
+int journal_room(struct journal *j)
+{
+    pthread_mutex_lock(&j->lock);
+    int room = j->txn_max - journal_txn_blks(j, j->ntxn + 1, j->nrevokes) + 1;
+    pthread_mutex_unlock(&j->lock);
+    return room;
+}
+
+int journal_commit(struct journal *j)
+{
+    int result;
+
+    pthread_mutex_lock(&j->lock);
+    if (j->ntxn == 0 && j->nrevokes == 0) {
+        /* nothing logged: still make earlier writes durable */
+        result = j->dev->ops->flush(j->dev, 0, j->dev->ops->num_blocks(j->dev));
+    } else {
+        result = journal_commit_locked(j);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return result;
+}
+
+int journal_checkpoint(struct journal *j)
+{
+    pthread_mutex_lock(&j->lock);
+    int result = journal_commit_locked(j);
+    if (result == SUCCESS) {
+        result = journal_checkpoint_locked(j);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return result;
+}
+
+int journal_close(struct journal *j)
+{
+    int result = j->nbufs > 0 ? journal_checkpoint(j) : SUCCESS;
+    pthread_mutex_destroy(&j->lock);
+    free(j->bufs);
+    free(j->hash);
+    free(j->list);
+    free(j->txn);
+    free(j->revokes);
+    free(j->descs);
+    free(j->iov);
+    free(j);
+    return result;
+}
@@ -0,0 +1,118 @@
+/*
+ * file:        journal.h
+ * description: Write-ahead journal for file system metadata blocks
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+
+#include "blkdev.h"
+
+/** smallest journal size in blocks */
+enum {JOURNAL_MIN_BLKS = 16};
+
+struct journal;
+
+/**
+ * Write an empty journal to a region of a block device.
+ *
+ * @param dev the block device
+ * @param start the first block of the journal
+ * @param nblks the journal size in blocks, at least JOURNAL_MIN_BLKS
+ * @return SUCCESS if successful, or device error
+ */
+extern int journal_format(struct blkdev *dev, int start, int nblks);
+
+/**
+ * Open the journal in a region of a block device. The journal
+ * must be replayed before the file system reads any metadata.
+ *
+ * @param dev the block device
+ * @param start the first block of the journal
+ * @param nblks the journal size in blocks
+ * @return the journal, or NULL if the region does not hold a journal
+ *   or cannot allocate the journal
+ */
+extern struct journal *journal_open(struct blkdev *dev, int start, int nblks);
+
+/**
+ * Write the blocks of every complete transaction in the journal to
+ * their home locations, and empty the journal.
+ *
+ * @param j the journal
+ * @return number of transactions replayed, or device error
+ */
+extern int journal_replay(struct journal *j);
+
+/**
+ * Get the latest copy of a block logged since the last checkpoint.
+ * Home locations of such blocks may be out of date.
+ *
+ * @param j the journal
+ * @param blkno the block number
+ * @param buf the buffer for the block contents
+ * @return true if the block was copied from the journal
+ */
+extern bool journal_read(struct journal *j, int blkno, void *buf);
+
+/**
+ * Log a block in the running transaction, instead of writing it to
+ * its home location. The transaction is committed first if it has
+ * no room for the block.
+ *
+ * @param j the journal
+ * @param blkno the block number
+ * @param data the block contents
+ * @return SUCCESS if successful, or device error
+ */
+extern int journal_log(struct journal *j, int blkno, const void *data);
+
+/**
+ * Forget a logged block that has been freed, so neither a checkpoint
+ * nor replay of an earlier transaction overwrites its next use.
+ *
+ * @param j the journal
+ * @param blkno the block number
+ * @return SUCCESS if successful, or device error
+ */
+extern int journal_revoke(struct journal *j, int blkno);
+
+/**
+ * Get the number of blocks that can be logged before the running
+ * transaction has to be committed.
+ *
+ * @param j the journal
+ * @return number of blocks
+ */
+extern int journal_room(struct journal *j);
+
+/**
+ * Commit the running transaction with one sequential write per
+ * contiguous part of the log, then flush the device. A checkpoint
+ * follows if the log is running out of space.
+ *
+ * @param j the journal
+ * @return SUCCESS if successful, or device error
+ */
+extern int journal_commit(struct journal *j);
+
+/**
+ * Commit the running transaction, write every logged block to its
+ * home location, and empty the journal.
+ *
+ * @param j the journal
+ * @return SUCCESS if successful, or device error
+ */
+extern int journal_checkpoint(struct journal *j);
+
+/**
+ * Checkpoint and free a journal.
+ *
+ * @param j the journal
+ * @return SUCCESS if successful, or device error
+ */
+extern int journal_close(struct journal *j);
+
+#endif /* JOURNAL_H_ */
@@ -25,6 +25,7 @@ struct stat sb;
 #include <sys/types.h>
 #include <fuse.h>
 #include "image.h"
+#include "bcache.h"
 
 #include "fsx600.h"		/* only for certain constants */
 
@@ -36,6 +37,9 @@ extern char *strdup(const char* str);
  * All homework functions accessed through operations structure. */
 extern struct fuse_operations fs_ops;
 
+/** readahead counters, from homework.c */
+extern bool fs_readahead_stats(long *prefetched, long *hits);
+
 /**  disk block device */
 struct blkdev *disk;
 
@@ -43,8 +47,18 @@ struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   cache_blks;
+    int   mmap_mode;
+    int   uring_mode;
+    int   writeback_mode;
+    int   journal_blks;
+    int   delalloc_mode;
+    int   extents_mode;
 } _data;
 int homework_part;
+int journal_size;
+int delalloc_mode;
+int extents_mode;
 
 /**
  * Constant: maximum path length
@@ -55,6 +69,13 @@ static void help(){
     printf("Arguments:\n");
     printf(" -cmdline : Enter an interactive REPL that provides a filesystem view into the image\n");
     printf(" -image <name.img> : Use the provided image file that contains the filesystem\n");
+    printf(" -mmap : Access the image file through a shared memory mapping instead of pread/pwrite\n");
+    printf(" -uring : Perform batched block requests asynchronously through io_uring\n");
+    printf(" -cache <nblks> : Size of the block cache in blocks, 0 to disable (default %d)\n", BCACHE_DEFAULT_BLKS);
+    printf(" -writeback : Hold written blocks in the block cache and write them back in the background\n");
+    printf(" -journal <nblks> : Add a metadata journal of this many blocks if the image has none\n");
+    printf(" -delalloc : Buffer appended blocks and allocate them when metadata is flushed\n");
+    printf(" -extents : Map new files by extents; the image can then only be mounted by code that supports them\n");
 //    printf(" -part # : Give either 1, 2 or 3 that correlates to the question in the homework being tested. This will set the homework_part global variable, which may be useful for you as your program runs.\n");
 }
 
@@ -62,13 +83,27 @@ static void help(){
  * See comments in /usr/include/fuse/fuse_opts.h for details of
  * FUSE argument processing.
  *
- *  usage: ./homework -image disk.img [-part #] directory
+ *  usage: ./homework -image disk.img [-mmap|-uring] [-cache #] [-writeback] [-journal #] [-delalloc] [-extents] [-part #] directory
  *              disk.img  - name of the image file to mount
+ *              -mmap     - map image file instead of pread/pwrite
+ *              -uring    - batch block requests through io_uring
+ *              -cache #  - block cache size in blocks
+ *              -writeback - write-back instead of write-through block cache
+ *              -journal # - add a metadata journal of # blocks
+ *              -delalloc - delay allocating appended blocks
+ *              -extents  - map new files by extents
  *              directory - directory to mount it on
  */
 static struct fuse_opt opts[] = {
         {"-image %s", offsetof(struct data, image_name), 0},
         {"-cmdline", offsetof(struct data, cmd_mode), 1},
+        {"-cache %d", offsetof(struct data, cache_blks), 0},
+        {"-mmap", offsetof(struct data, mmap_mode), 1},
+        {"-uring", offsetof(struct data, uring_mode), 1},
+        {"-writeback", offsetof(struct data, writeback_mode), 1},
+        {"-journal %d", offsetof(struct data, journal_blks), 0},
+        {"-delalloc", offsetof(struct data, delalloc_mode), 1},
+        {"-extents", offsetof(struct data, extents_mode), 1},
 // PJG -- temporary
 //    {"-part %d", offsetof(struct data, part), 0},
         FUSE_OPT_END
@@ -270,17 +305,36 @@ static int do_pwd(char *argv[])
     return 0;
 }
 
-static char lsbuf[DIRENTS_PER_BLK][MAX_PATH]; /** buffer to list directory entries */
+static char (*lsbuf)[MAX_PATH]; /** buffer to list directory entries */
 static int  lsi;  /* current ls index */
+static int  lsmax;  /* number of entries in lsbuf */
 
 static void init_ls(void)
 {
     lsi = 0;
 }
 
+/**
+ * Get the next ls buffer entry, growing the buffer if needed,
+ * since directories can have any number of entries.
+ *
+ * @return the next entry
+ */
+static char *next_ls(void)
+{
+    if (lsi == lsmax) {
+        lsmax = lsmax == 0 ? DIRENTS_PER_BLK : 2 * lsmax;
+        lsbuf = realloc(lsbuf, lsmax * sizeof(*lsbuf));
+        if (lsbuf == NULL) {
+            exit(1);
+        }
+    }
+    return lsbuf[lsi++];
+}
+
 static int filler(void *buf, const char *name, const struct stat *sb, off_t off)
 {
-    sprintf(lsbuf[lsi++], "%s\n", name);
+    sprintf(next_ls(), "%s\n", name);
     return 0;
 }
 
@@ -335,7 +389,7 @@ static int do_ls0(char *argv[])
 static int dashl_filler(void *buf, const char *name, const struct stat *sb, off_t off)
 {
     char mode[16], time[26], *lasts;
-    sprintf(lsbuf[lsi++], "%5lld %s %2d %4d %4d %8lld %s %s\n",
+    sprintf(next_ls(), "%5lld %s %2d %4d %4d %8lld %s %s\n",
             sb->st_blocks, strmode(mode, sb->st_mode),
             sb->st_nlink, sb->st_uid, sb->st_gid, sb->st_size,
             strtok_r(ctime_r(&sb->st_mtime,time),"\n",&lasts), name);
@@ -633,6 +687,33 @@ static int do_stat(char *argv[])
     return retval;
 }
 
+/**
+ * Print block cache statistics
+ *
+ * @argv unused
+ */
+static int do_cache(char *argv[])
+{
+    long hits, misses;
+    if (bcache_stats(disk, &hits, &misses) != SUCCESS) {
+        printf("block cache disabled\n");
+        return 0;
+    }
+    printf("cache hits: %ld\n", hits);
+    printf("cache misses: %ld\n", misses);
+    long prefetched, ra_hits;
+    if (fs_readahead_stats(&prefetched, &ra_hits)) {
+        printf("readahead blocks: %ld\n", prefetched);
+        printf("readahead hits: %ld\n", ra_hits);
+    }
+    long dirty, written_back;
+    if (_data.writeback_mode && bcache_writeback_stats(disk, &dirty, &written_back) == SUCCESS) {
+        printf("dirty blocks: %ld\n", dirty);
+        printf("blocks written back: %ld\n", written_back);
+    }
+    return 0;
+}
+
 /**
  * Set read/write block size
  *
@@ -738,6 +819,7 @@ static struct {
         {"utime", 1, do_utime, "utime <file> - set modified time to current time"},
         {"touch", 1, do_touch, "touch <file> - create file or set modified time to current time"},
         {"stat", 1, do_stat, "stat <file> - print file info"},
+        {"cache", 0, do_cache, "cache - print block cache statistics"},
         {0, 0, 0}
 };
 
@@ -837,6 +919,7 @@ int main(int argc, char **argv)
     /* Argument processing and checking
      */
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    _data.cache_blks = BCACHE_DEFAULT_BLKS;
     if (fuse_opt_parse(&args, &_data, opts, NULL) == -1){
         help();
         exit(1);
@@ -855,19 +938,49 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    if ((disk = image_create(file)) == NULL) {
+    if (_data.mmap_mode && _data.uring_mode) {
+        fprintf(stderr, "-mmap and -uring cannot be used together\n");
+        help();
+        exit(1);
+    }
+
+    if (_data.uring_mode) {
+        disk = image_uring_create(file);
+    } else if (_data.mmap_mode) {
+        disk = image_mmap_create(file);
+    } else {
+        disk = image_create(file);
+    }
+    if (disk == NULL) {
         fprintf(stderr, "cannot open image file '%s': %s\n", file, strerror(errno));
         help();
         exit(1);
     }
 
+    /* all file system block access goes through the block cache */
+    if ((disk = bcache_create(disk, _data.cache_blks)) == NULL) {
+        fprintf(stderr, "cannot create block cache for '%s'\n", file);
+        exit(1);
+    }
+    if (_data.writeback_mode && bcache_set_writeback(disk) != SUCCESS) {
+        fprintf(stderr, "-writeback requires the block cache\n");
+        help();
+        exit(1);
+    }
+
 //    homework_part = _data.part;
     homework_part = 2; // PJG
+    journal_size = _data.journal_blks;
+    delalloc_mode = _data.delalloc_mode;
+    extents_mode = _data.extents_mode;
 
     if (_data.cmd_mode) {  /* process interactive commands */
         fs_ops.init(NULL);
         _blksiz(FS_BLOCK_SIZE);
         cmdloop();
+        if (fs_ops.destroy) {
+            fs_ops.destroy(NULL);
+        }
         return 0;
     }
 
@@ -0,0 +1,193 @@
+/*
+ * file:        mkfs.c
+ * description: Create an empty fsx600 file system image, with all
+ *              its maps and inodes after the superblock, or divided
+ *              into block groups, optionally with extent-mapped files.
+ *
+ * usage: mkfs-x6 [-groups] [-group-blocks n] [-extents] image nblocks
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fsx600.h"
+#include "bitmap.h"
+
+/** blocks per inode */
+enum {BLKS_PER_INODE = 4};
+
+/** default and smallest group size in blocks */
+enum {GROUP_BLKS = 4 * BITS_PER_BLK, MIN_GROUP_BLKS = BITS_PER_BLK};
+
+/** image file */
+static int fd;
+
+/**
+ * Write blocks to the image, exiting on error.
+ *
+ * @param blkno the first block
+ * @param nblks the number of blocks
+ * @param buf the block contents
+ */
+static void write_blks(int blkno, int nblks, const void *buf)
+{
+    size_t len = (size_t) nblks * FS_BLOCK_SIZE;
+    if (pwrite(fd, buf, len, (off_t) blkno * FS_BLOCK_SIZE) != (ssize_t) len) {
+        perror("write");
+        exit(1);
+    }
+}
+
+/**
+ * Allocate zeroed memory, exiting on error.
+ *
+ * @param nblks the size in blocks
+ * @return the memory
+ */
+static void *alloc_blks(int nblks)
+{
+    void *buf = calloc(nblks, FS_BLOCK_SIZE);
+    if (buf == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return buf;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mkfs-x6 [-groups] [-group-blocks n] [-extents] image nblocks\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int use_groups = 0, use_extents = 0, group_blks = GROUP_BLKS;
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-groups") == 0) {
+            use_groups = 1;
+        } else if (strcmp(argv[i], "-group-blocks") == 0 && i + 1 < argc) {
+            use_groups = 1;
+            group_blks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-extents") == 0) {
+            use_extents = 1;
+        } else {
+            usage();
+        }
+    }
+    if (argc - i != 2) usage();
+    char *image = argv[i];
+    int nblks = atoi(argv[i + 1]);
+    if (group_blks < MIN_GROUP_BLKS || group_blks % BITS_PER_BLK != 0) {
+        fprintf(stderr, "group size must be a multiple of %d blocks\n", BITS_PER_BLK);
+        exit(1);
+    }
+
+    struct fs_super sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = FS_MAGIC;
+    sb.root_inode = 1;
+
+    // lay out each group's slices of the maps and inodes, or one
+    // "group" holding the disk, with the maps and inodes in turn
+    int n_groups, group_inodes, group0_start;
+    int bmap_base, imap_base, inode_base, bmap_blks, imap_blks, inode_blks;
+    if (use_groups) {
+        group_inodes = (group_blks / BLKS_PER_INODE + BITS_PER_BLK - 1) /
+                       BITS_PER_BLK * BITS_PER_BLK;
+        bmap_blks = group_blks / BITS_PER_BLK;
+        imap_blks = group_inodes / BITS_PER_BLK;
+        inode_blks = group_inodes / INODES_PER_BLK;
+        bmap_base = 0;
+        imap_base = bmap_blks;
+        inode_base = imap_base + imap_blks;
+
+        // drop a last group too short for its metadata and a few blocks
+        n_groups = (nblks + group_blks - 1) / group_blks;
+        int last = nblks - (n_groups - 1) * group_blks;
+        int table_blks = (n_groups + GROUPS_PER_BLK - 1) / GROUPS_PER_BLK;
+        int meta = inode_base + inode_blks + (n_groups == 1 ? 1 + table_blks : 0);
+        if (last < meta + BITS_PER_BLK / 8) {
+            n_groups--;
+            nblks = n_groups * group_blks;
+        }
+        if (n_groups == 0) {
+            fprintf(stderr, "image must be at least %d blocks\n", meta + BITS_PER_BLK / 8);
+            exit(1);
+        }
+        group0_start = 1 + (n_groups + GROUPS_PER_BLK - 1) / GROUPS_PER_BLK;
+
+        sb.features = FS_FEATURE_GROUPS;
+        sb.group_blks = group_blks;
+        sb.group_inodes = group_inodes;
+    } else {
+        n_groups = 1;
+        group_blks = nblks;
+        inode_blks = nblks / BLKS_PER_INODE / INODES_PER_BLK;
+        if (inode_blks < 4) inode_blks = 4;
+        group_inodes = inode_blks * INODES_PER_BLK;
+        imap_blks = (group_inodes + BITS_PER_BLK - 1) / BITS_PER_BLK;
+        bmap_blks = (nblks + BITS_PER_BLK - 1) / BITS_PER_BLK;
+        group0_start = 0;
+        imap_base = 1;
+        bmap_base = imap_base + imap_blks;
+        inode_base = bmap_base + bmap_blks;
+    }
+    if (use_extents) sb.features |= FS_FEATURE_EXTENTS;
+    sb.num_blocks = nblks;
+    sb.inode_map_sz = n_groups * imap_blks;
+    sb.block_map_sz = n_groups * bmap_blks;
+    sb.inode_region_sz = n_groups * inode_blks;
+
+    fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, (off_t) nblks * FS_BLOCK_SIZE) < 0) {
+        perror(image);
+        exit(1);
+    }
+
+    // mark each group's metadata in use, and the blocks past the end
+    uint64_t *block_map = alloc_blks(sb.block_map_sz);
+    uint64_t *inode_map = alloc_blks(sb.inode_map_sz);
+    for (int g = 0; g < n_groups; g++) {
+        int start = g == 0 ? group0_start : g * group_blks;
+        for (int b = g * group_blks; b < start + inode_base + inode_blks; b++) {
+            bitmap_set(block_map, b);
+        }
+    }
+    for (int b = nblks; b < (int) sb.block_map_sz * BITS_PER_BLK; b++) {
+        bitmap_set(block_map, b);
+    }
+    bitmap_set(inode_map, 0);
+    bitmap_set(inode_map, 1);
+
+    // root directory, with one empty block
+    int root_blk = group0_start + inode_base + inode_blks;
+    bitmap_set(block_map, root_blk);
+    struct fs_inode *inodes = alloc_blks(inode_blks);
+    inodes[1].mode = S_IFDIR | 0777;
+    inodes[1].direct[0] = root_blk;
+    char *zeros = alloc_blks(1);
+    write_blks(root_blk, 1, zeros);
+
+    // write each group's map slices and group 0's inodes; the rest
+    // of the image, including the group table, reads as zeros
+    for (int g = 0; g < n_groups; g++) {
+        int start = g == 0 ? group0_start : g * group_blks;
+        write_blks(start + bmap_base, bmap_blks, (char*) block_map + g * bmap_blks * FS_BLOCK_SIZE);
+        write_blks(start + imap_base, imap_blks, (char*) inode_map + g * imap_blks * FS_BLOCK_SIZE);
+    }
+    write_blks(group0_start + inode_base, inode_blks, inodes);
+    write_blks(0, 1, &sb);
+
+    if (fsync(fd) < 0 || close(fd) < 0) {
+        perror(image);
+        exit(1);
+    }
+    return 0;
+}